@@ -4,249 +4,733 @@
 #include <string.h>
 
 #include "circuit.h"
-
-enode *parse_binary_operation(char *expression,
-                              size_t expression_length,
-                              unsigned int dependent_variables[],
-                              unsigned int variables_count) {
-    enode *node = malloc(sizeof(enode));
-
-    char *current_char = expression;
-    char *left_expression_begin = expression + 1;
-    char *right_expression_begin;
-
-    size_t left_expression_length = 0;
-    size_t right_expression_length = 0;
-
-    int operator_found = 0;
-    unsigned int opened_parentheses = 0;
-
-    do {
-        ++current_char;
-        if (*current_char == '(') {
-            ++opened_parentheses;
-        } else if (*current_char == ')') {
-            --opened_parentheses;
-        } else if (*current_char == '+' || *current_char == '*') {
-            operator_found = 1;
-        }
-        ++left_expression_length;
-    } while (opened_parentheses != 0 || operator_found == 0);
-
-    if (*current_char == '+' || *current_char == '*') {
-        --left_expression_length; /// Counted characters includes space and operator
-    } else {
-        ++left_expression_length; /// Need to add null at the end of the string.
-        current_char += 2;
+#include "server.h"
+
+enode *allocate_node(earena **arena) {
+    if (*arena == NULL || (*arena)->used == ARENA_CHUNK) {
+        earena *chunk = malloc(sizeof(earena));
+        chunk->used = 0;
+        chunk->previous = *arena;
+        *arena = chunk;
     }
-    node->operation_code = *current_char;
-
-    right_expression_begin = current_char + 2;
-    right_expression_length = (expression_length - (left_expression_length + 2)) - 2;
-
-    char *left_expression = malloc(left_expression_length * sizeof(char));
-    char *right_expression = malloc(right_expression_length * sizeof(char));
-
-    strncpy(left_expression, left_expression_begin, left_expression_length);
-    strncpy(right_expression, right_expression_begin, right_expression_length);
 
-    left_expression[left_expression_length - 1] = 0;
-    right_expression[right_expression_length - 1] = 0;
-
-    node->left_son = parse_expression(left_expression, left_expression_length, dependent_variables, variables_count);
-    node->right_son = parse_expression(right_expression, right_expression_length, dependent_variables, variables_count);
+    return &(*arena)->nodes[(*arena)->used++];
+}
 
-    free(left_expression);
-    free(right_expression);
+void release_arena(earena *arena) {
+    earena *previous;
 
-    return node;
+    while (arena != NULL) {
+        previous = arena->previous;
+        free(arena);
+        arena = previous;
+    }
 }
 
-enode *parse_variable(const char *expression,
-                      unsigned int dependent_variables[]) {
-    enode *node = malloc(sizeof(enode));
+enode *parse_variable(const char *expression, const char **end, pcontext *context) {
+    enode *node = allocate_node(&context->arena);
 
     node->operation_code = VARIABLE_CODE;
     node->right_son = NULL;
     node->left_son = NULL;
-    sscanf(expression, "x[%ld]", &node->value);
+    node->value = strtol(expression + 2, (char **) end, 10);
+    ++*end; /// Skipping closing bracket.
 
-    dependent_variables[node->value] = 1;
+    if (context->dependency_marks[node->value] == 0) {
+        context->dependency_marks[node->value] = 1;
+
+        if (context->dependencies_count == context->dependencies_capacity) {
+            context->dependencies_capacity *= 2;
+            context->dependencies = realloc(context->dependencies,
+                                            context->dependencies_capacity * sizeof(unsigned int));
+        }
+        context->dependencies[context->dependencies_count++] = (unsigned int) node->value;
+    }
 
     return node;
 }
 
-enode *parse_value(const char *expression) {
-    enode *node = malloc(sizeof(enode));
+enode *parse_value(const char *expression, const char **end, pcontext *context) {
+    enode *node = allocate_node(&context->arena);
 
     node->operation_code = VALUE_CODE;
     node->right_son = NULL;
     node->left_son = NULL;
-    sscanf(expression, "%ld", &node->value);
+    node->value = strtol(expression, (char **) end, 10);
 
     return node;
 }
 
-enode *parse_unary_operation(char *expression,
-                             size_t expression_length,
-                             unsigned int dependent_variables[],
-                             unsigned int variables_count) {
-    enode *node = malloc(sizeof(enode));
+enode *parse_operation(int operation_code, pcontext *context) {
+    enode *node = allocate_node(&context->arena);
+
+    node->operation_code = operation_code;
+    node->left_son = NULL;
+    node->right_son = NULL;
+
+    if (context->pending_count == context->pending_capacity) {
+        context->pending_capacity *= 2;
+        context->pending = realloc(context->pending, context->pending_capacity * sizeof(enode *));
+    }
+    context->pending[context->pending_count++] = node;
 
-    char *new_expression = NULL;
-    node->operation_code = '-';
-    size_t new_expression_length = expression_length - 3;
-    new_expression = malloc(new_expression_length * sizeof(char));
-    strncpy(new_expression, expression + 2, new_expression_length);
-    node->left_son = parse_expression(new_expression, new_expression_length, dependent_variables, variables_count);
     return node;
 }
 
-enode *parse_expression(char *expression,
-                        size_t expression_length,
-                        unsigned int dependent_variables[],
-                        unsigned int variables_count) {
-    if (expression == NULL) {
-        return NULL;
+const char *skip_spaces(const char *expression) {
+    while (*expression == ' ') {
+        ++expression;
     }
 
-    if (expression[0] == '(') {
-        if (expression[1] == '-') {
-            return parse_unary_operation(expression, expression_length, dependent_variables, variables_count);
+    return expression;
+}
+
+enode *parse_expression(const char *expression, pcontext *context) {
+    enode *completed;
+
+    context->pending_count = 0;
+
+    /// Operations waiting for their operands are kept on a heap stack, so nesting depth is not
+    /// bounded by the C stack. Binary operation code is only known once its left operand is parsed.
+    while (1) {
+        expression = skip_spaces(expression);
+
+        if (*expression == '(') {
+            expression = skip_spaces(expression + 1);
+            if (*expression == '-') {
+                parse_operation('-', context);
+                ++expression;
+            } else {
+                parse_operation(0, context);
+            }
+            continue;
+        } else if (*expression == 'x') {
+            completed = parse_variable(expression, &expression, context);
         } else {
-            return parse_binary_operation(expression, expression_length, dependent_variables, variables_count);
+            completed = parse_value(expression, &expression, context);
+        }
+
+        while (1) {
+            if (context->pending_count == 0) {
+                return completed;
+            }
+
+            enode *parent = context->pending[context->pending_count - 1];
+            expression = skip_spaces(expression);
+
+            if (parent->operation_code != '-' && parent->left_son == NULL) {
+                parent->left_son = completed;
+                parent->operation_code = *expression;
+                ++expression;
+                break;
+            }
+
+            if (parent->operation_code == '-') {
+                parent->left_son = completed;
+            } else {
+                parent->right_son = completed;
+            }
+
+            ++expression; /// Skipping closing parenthesis.
+            completed = parent;
+            --context->pending_count;
         }
-    } else if (*expression == 'x') {
-        return parse_variable(expression, dependent_variables);
-    } else {
-        return parse_value(expression);
     }
 }
 
-int parse_single_equation(char *expression, size_t expression_length, ddag *dgraph, unsigned int variables_count) {
-    int variable_index;
+void parse_single_equation(const char *expression, pequation *equation, pcontext *context) {
     int chars_read;
 
-    sscanf(expression, "x[%d] = %n", &variable_index, &chars_read);
+    sscanf(expression, "x[%d] = %n", &equation->variable_index, &chars_read);
 
-    unsigned int dependent_variables[variables_count];
-    memset(dependent_variables, 0, sizeof dependent_variables);
+    context->dependencies_count = 0;
+    equation->expression = parse_expression(expression + chars_read, context);
 
-    dnode *node = &dgraph->variables[variable_index];
+    equation->dependencies_count = context->dependencies_count;
+    equation->dependencies = malloc(context->dependencies_count * sizeof(unsigned int));
 
-    if (node->expression != NULL) {
-        return -1;
+    for (int i = 0; i < context->dependencies_count; ++i) {
+        equation->dependencies[i] = context->dependencies[i];
+        context->dependency_marks[context->dependencies[i]] = 0;
     }
+}
 
-    expression += chars_read;
-    expression_length -= chars_read;
+void *parse_equations_range(void *data) {
+    pworker *worker = data;
+    pcontext context;
+
+    context.arena = NULL;
+    context.dependency_marks = calloc(worker->variables_count, sizeof(unsigned int));
+    context.dependencies_capacity = 16;
+    context.dependencies = malloc(context.dependencies_capacity * sizeof(unsigned int));
+    context.pending_capacity = 16;
+    context.pending = malloc(context.pending_capacity * sizeof(enode *));
 
-    node->expression = parse_expression(expression,
-                                        expression_length,
-                                        dependent_variables,
-                                        variables_count);
+    for (unsigned int i = worker->first_equation; i < worker->last_equation; ++i) {
+        parse_single_equation(worker->lines[i], &worker->equations[i], &context);
+    }
 
-    dlist **tail = &node->dependent_variables;
+    free(context.dependency_marks);
+    free(context.dependencies);
+    free(context.pending);
 
-    for (int i = 0; i < variables_count; ++i) {
-        if (dependent_variables[i] == 1) {
-            dlist *new_list = malloc(sizeof(dlist));
-            new_list->variable = &dgraph->variables[i];
+    worker->arena = context.arena;
 
-            *tail = new_list;
-            tail = &new_list->next;
+    return NULL;
+}
+
+void parse_equations(ddag *dependency_graph, char **lines, pequation *equations,
+                     unsigned int equations_count, unsigned int threads_count) {
+    /// Small batches are not worth a thread of their own.
+    if (threads_count > equations_count / PARSE_BATCH_MIN) {
+        threads_count = equations_count / PARSE_BATCH_MIN;
+    }
+    if (threads_count == 0) {
+        threads_count = 1;
+    }
+
+    pworker *workers = malloc(threads_count * sizeof(pworker));
+
+    for (unsigned int t = 0; t < threads_count; ++t) {
+        workers[t].lines = lines;
+        workers[t].equations = equations;
+        workers[t].first_equation = (unsigned int) ((unsigned long) equations_count * t / threads_count);
+        workers[t].last_equation = (unsigned int) ((unsigned long) equations_count * (t + 1) / threads_count);
+        workers[t].variables_count = dependency_graph->variables_count;
+        workers[t].arena = NULL;
+    }
+
+    /// The calling thread parses the first batch itself.
+    for (unsigned int t = 1; t < threads_count; ++t) {
+        if (pthread_create(&workers[t].thread, NULL, parse_equations_range, &workers[t]) != 0) {
+            fatal("Error in pthread_create");
         }
     }
 
-    *tail = NULL;
+    parse_equations_range(&workers[0]);
 
-    return 1;
+    for (unsigned int t = 1; t < threads_count; ++t) {
+        if (pthread_join(workers[t].thread, NULL) != 0) {
+            fatal("Error in pthread_join");
+        }
+    }
+
+    dependency_graph->arenas = malloc(threads_count * sizeof(earena *));
+    dependency_graph->arenas_count = threads_count;
+
+    for (unsigned int t = 0; t < threads_count; ++t) {
+        dependency_graph->arenas[t] = workers[t].arena;
+    }
+
+    free(workers);
 }
 
-void release_memory(ddag *dependencies) {
-    for (int i = 0; i < dependencies->variables_count; ++i) {
-        release_variable(dependencies->variables[i]);
+unsigned int merge_equations(ddag *dependency_graph, pequation *equations, unsigned int equations_count) {
+    unsigned int merged;
+
+    for (merged = 0; merged < equations_count; ++merged) {
+        pequation *equation = &equations[merged];
+        dnode *node = &dependency_graph->variables[equation->variable_index];
+
+        if (node->expression != NULL) {
+            break; /// Variable is redefined, everything from here on is discarded.
+        }
+
+        node->expression = equation->expression;
+        node->equation_index = merged;
     }
 
-    free(dependencies->variables);
-    free(dependencies);
+    build_adjacency(dependency_graph, equations, merged);
+
+    for (unsigned int i = 0; i < equations_count; ++i) {
+        free(equations[i].dependencies);
+    }
+
+    return merged;
 }
 
-void release_variable(dnode variable) {
-    release_expression(variable.expression);
-    release_dependency_list(variable.dependent_variables);
+void build_adjacency(ddag *dependency_graph, pequation *equations, unsigned int equations_count) {
+    unsigned int variables_count = dependency_graph->variables_count;
+    unsigned int *offsets = calloc(variables_count + 1, sizeof(unsigned int));
+    unsigned int *reverse_offsets = calloc(variables_count + 1, sizeof(unsigned int));
+    unsigned int edges_count = 0;
+
+    for (unsigned int i = 0; i < equations_count; ++i) {
+        offsets[equations[i].variable_index + 1] = equations[i].dependencies_count;
+        edges_count += equations[i].dependencies_count;
+
+        for (int d = 0; d < equations[i].dependencies_count; ++d) {
+            ++reverse_offsets[equations[i].dependencies[d] + 1];
+        }
+    }
+
+    for (unsigned int v = 0; v < variables_count; ++v) {
+        offsets[v + 1] += offsets[v];
+        reverse_offsets[v + 1] += reverse_offsets[v];
+    }
+
+    unsigned int *targets = malloc(edges_count * sizeof(unsigned int));
+    unsigned int *reverse_targets = malloc(edges_count * sizeof(unsigned int));
+    unsigned int *reverse_filled = calloc(variables_count, sizeof(unsigned int));
+
+    for (unsigned int i = 0; i < equations_count; ++i) {
+        int v = equations[i].variable_index;
+
+        for (int d = 0; d < equations[i].dependencies_count; ++d) {
+            unsigned int u = equations[i].dependencies[d];
+
+            targets[offsets[v] + d] = u;
+            reverse_targets[reverse_offsets[u] + reverse_filled[u]++] = (unsigned int) v;
+        }
+    }
+
+    free(reverse_filled);
+
+    dependency_graph->dependency_offsets = offsets;
+    dependency_graph->dependency_targets = targets;
+    dependency_graph->dependent_offsets = reverse_offsets;
+    dependency_graph->dependent_targets = reverse_targets;
 }
 
-void release_dependency_list(dlist *list_element) {
-    dlist *next;
+void compute_reachability(ddag *dependency_graph) {
+    unsigned int variables_count = dependency_graph->variables_count;
+    unsigned int words = (variables_count + WORD_BITS - 1) / WORD_BITS;
+
+    dependency_graph->bitset_words = words;
+    dependency_graph->defined = calloc(words, sizeof(unsigned long));
+
+    for (unsigned int v = 0; v < variables_count; ++v) {
+        if (dependency_graph->variables[v].expression != NULL) {
+            dependency_graph->defined[v / WORD_BITS] |= 1UL << (v % WORD_BITS);
+        }
+    }
+
+    if (variables_count > REACHABILITY_MAX_VARIABLES) {
+        return;
+    }
+
+    unsigned int *order = malloc(variables_count * sizeof(unsigned int));
+    unsigned long *reachability = calloc((size_t) variables_count * words, sizeof(unsigned long));
+
+    topological_sort(dependency_graph, NO_EQUATION, order);
+
+    /// Dependencies come first in the order, so their rows are complete when needed.
+    for (unsigned int i = 0; i < variables_count; ++i) {
+        unsigned int v = order[i];
+        unsigned long *row = reachability + (size_t) v * words;
+
+        row[v / WORD_BITS] |= 1UL << (v % WORD_BITS);
 
-    while (list_element != NULL) {
-        next = list_element->next;
-        free(list_element);
-        list_element = next;
+        for (unsigned int e = dependency_graph->dependency_offsets[v];
+             e < dependency_graph->dependency_offsets[v + 1]; ++e) {
+            unsigned long *dependency_row = reachability + (size_t) dependency_graph->dependency_targets[e] * words;
+
+            for (unsigned int w = 0; w < words; ++w) {
+                row[w] |= dependency_row[w];
+            }
+        }
     }
+
+    free(order);
+
+    dependency_graph->reachability = reachability;
 }
 
-void release_expression(enode *expression) {
-    if (expression != NULL) {
-        release_expression(expression->left_son);
-        release_expression(expression->right_son);
-        free(expression);
+void release_memory(ddag *dependencies) {
+    for (unsigned int i = 0; i < dependencies->arenas_count; ++i) {
+        release_arena(dependencies->arenas[i]);
     }
+
+    free(dependencies->arenas);
+    free(dependencies->dependency_offsets);
+    free(dependencies->dependency_targets);
+    free(dependencies->dependent_offsets);
+    free(dependencies->dependent_targets);
+    free(dependencies->reachability);
+    free(dependencies->defined);
+    free(dependencies->variables);
+    free(dependencies);
 }
 
-void process_single_input(unsigned int variables_count, const ddag *dependency_graph, const int *active_circuits,
-                          const long *variables_values, int equation_number) {
-    unsigned int childs_count = 0;
-    int var_pipes[variables_count][2];
+void process_single_input(unsigned int variables_count, const ddag *dependency_graph, const ovariables *outputs,
+                          const int *active_circuits, const long *variables_values, const int *outputs_solvable,
+                          const rrecord *line, rchannel *results) {
+    tspan line_span;
 
-    for (int j = 0; j < variables_count; ++j) {
-        if (pipe(var_pipes[j]) == -1) {
-            syserr("Error in pipe\n");
-        }
+    trace_set_line(line->equation_number);
+    trace_begin(&line_span, "line", "line %ld", line->equation_number);
+
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        syserr("Error in prctl\n");
     }
 
+    lpipes pipes;
+    open_line_pipes(&pipes, dependency_graph, outputs, active_circuits, variables_values);
+
+    ltrees trees;
+    open_line_trees(&trees, dependency_graph, outputs, active_circuits);
+
     for (int j = 0; j < variables_count; ++j) {
-        if (active_circuits[j] == LEAF) {
-            put_val_into_pipe(j, variables_values, var_pipes);
-        } else if (active_circuits[j] == ACTIVE) {
-            switch (fork()) {
+        if (active_circuits[j] == ACTIVE) {
+            /// Trees finished so far may already make the remaining ones unnecessary.
+            reap_line_trees(&trees, dependency_graph, active_circuits, WNOHANG);
+
+            if (trees.states[j] == TREE_RELEASED) {
+                release_tree_pipes(&pipes, dependency_graph, j);
+                continue;
+            }
+
+            acquire_tree_pipes(&pipes, dependency_graph, j, active_circuits, variables_values);
+
+            pid_t parent = getpid();
+            pid_t tree = fork();
+
+            switch (tree) {
                 case -1:
                     syserr("Error in fork\n");
                 case 0:
-                    spawn_tree(j, dependency_graph->variables, var_pipes);
-                    return;
+                    bind_to_parent(parent);
+                    /// Tree leads its own process group, so it can be cancelled as a whole.
+                    if (setpgid(0, 0) == -1) {
+                        syserr("Error in setpgid\n");
+                    }
+                    keep_tree_pipes(&pipes, dependency_graph, j);
+                    spawn_tree(j, dependency_graph->variables, pipes.fds);
+                    /// Only a tree which has delivered its value ends successfully.
+                    exit(0);
                 default:
-                    ++childs_count;
+                    if (setpgid(tree, tree) == -1 && errno != EACCES && errno != ESRCH) {
+                        syserr("Error in setpgid\n");
+                    }
+                    add_line_tree(&trees, j, tree);
+                    release_tree_pipes(&pipes, dependency_graph, j);
             }
         }
     }
 
-    char result_string[BUFF_SIZE];
-    if (read(var_pipes[0][0], result_string, BUFF_SIZE) == -1) {
-        syserr("Error while reading\n");
+    while (trees.running > 0) {
+        reap_line_trees(&trees, dependency_graph, active_circuits, 0);
     }
 
+    long *outputs_values = malloc(outputs->count * sizeof(long));
 
-    for (int p = 0; p < childs_count; ++p) {
-        if (wait(0) == -1) {
-            syserr("Error in wait\n");
+    for (unsigned int i = 0; i < outputs->count; ++i) {
+        char result_string[BUFF_SIZE];
+        unsigned int var_index = outputs->indices[i];
+
+        if (outputs_solvable[i] == 0) {
+            continue;
+        }
+
+        if (read(pipes.fds[var_index][0], result_string, BUFF_SIZE) == -1) {
+            syserr("Error while reading\n");
         }
+
+        /// Output may also be an input of another subcircuit, so its value goes back.
+        if (write(pipes.fds[var_index][1], result_string, BUFF_SIZE) == -1) {
+            syserr("Error while writing\n");
+        }
+
+        sscanf(result_string, "%ld", &outputs_values[i]);
+    }
+
+    close_line_trees(&trees);
+
+    /// Processes orphaned by cancelled subtrees are reparented to the line and reaped here.
+    while (wait(0) != -1) {
+    }
+
+    if (errno != ECHILD) {
+        syserr("Error in wait\n");
+    }
+
+    close_line_pipes(&pipes);
+
+    trace_end(&line_span);
+
+    for (unsigned int i = 0; i < outputs->count; ++i) {
+        rrecord result = *line;
+        result.worker = getpid();
+        result.output = i;
+        result.status = outputs_solvable[i] == 1 ? RESULT_PASSED : RESULT_FAILED;
+        result.value = outputs_solvable[i] == 1 ? outputs_values[i] : 0;
+
+        send_result(results, &result);
     }
 
-    for (int v = 0; v < variables_count; ++v) {
-        if (close(var_pipes[v][0]) == -1) {
+    free(outputs_values);
+}
+
+void open_line_trees(ltrees *trees, const ddag *dependency_graph, const ovariables *outputs,
+                     const int *active_circuits) {
+    unsigned int variables_count = dependency_graph->variables_count;
+    unsigned int trees_count = 0;
+    unsigned int capacity = 1;
+
+    trees->states = calloc(variables_count, sizeof(int));
+    trees->groups = calloc(variables_count, sizeof(pid_t));
+    trees->needed = calloc(variables_count, sizeof(unsigned int));
+    trees->released = malloc(variables_count * sizeof(unsigned int));
+    trees->running = 0;
+
+    for (unsigned int i = 0; i < outputs->count; ++i) {
+        ++trees->needed[outputs->indices[i]];
+    }
+
+    for (unsigned int v = 0; v < variables_count; ++v) {
+        if (active_circuits[v] != ACTIVE) {
+            continue;
+        }
+
+        for (unsigned int e = dependency_graph->dependency_offsets[v];
+             e < dependency_graph->dependency_offsets[v + 1]; ++e) {
+            ++trees->needed[dependency_graph->dependency_targets[e]];
+        }
+
+        ++trees_count;
+    }
+
+    while (capacity < trees_count) {
+        capacity *= 2;
+    }
+
+    /// At most half full, so probing stays short.
+    trees->pids = calloc(capacity * 2, sizeof(pid_t));
+    trees->pid_variables = malloc(capacity * 2 * sizeof(unsigned int));
+    trees->pids_mask = capacity * 2 - 1;
+}
+
+void add_line_tree(ltrees *trees, unsigned int var_index, pid_t pid) {
+    unsigned int slot = (unsigned int) pid & trees->pids_mask;
+
+    while (trees->pids[slot] != 0) {
+        slot = (slot + 1) & trees->pids_mask;
+    }
+
+    trees->pids[slot] = pid;
+    trees->pid_variables[slot] = var_index;
+    trees->states[var_index] = TREE_RUNNING;
+    trees->groups[var_index] = pid;
+    ++trees->running;
+}
+
+void release_dependencies(ltrees *trees, const ddag *dependency_graph, const int *active_circuits,
+                          unsigned int var_index) {
+    unsigned int released_count = 0;
+
+    trees->states[var_index] = TREE_RELEASED;
+    trees->released[released_count++] = var_index;
+
+    while (released_count > 0) {
+        unsigned int v = trees->released[--released_count];
+
+        for (unsigned int e = dependency_graph->dependency_offsets[v];
+             e < dependency_graph->dependency_offsets[v + 1]; ++e) {
+            unsigned int u = dependency_graph->dependency_targets[e];
+
+            if (--trees->needed[u] > 0 || active_circuits[u] != ACTIVE || trees->states[u] == TREE_RELEASED) {
+                continue;
+            }
+
+            /// Nobody is going to read the variable, its tree stops and stops needing its own dependencies.
+            if (trees->states[u] == TREE_RUNNING && killpg(trees->groups[u], SIGTERM) == -1 && errno != ESRCH) {
+                syserr("Error in killpg\n");
+            }
+
+            trees->states[u] = TREE_RELEASED;
+            trees->released[released_count++] = u;
+        }
+    }
+}
+
+void reap_line_trees(ltrees *trees, const ddag *dependency_graph, const int *active_circuits, int options) {
+    pid_t pid = 0;
+    int status;
+
+    while (trees->running > 0 && (pid = waitpid(-1, &status, options)) > 0) {
+        unsigned int slot = (unsigned int) pid & trees->pids_mask;
+
+        while (trees->pids[slot] != 0 && trees->pids[slot] != pid) {
+            slot = (slot + 1) & trees->pids_mask;
+        }
+
+        /// Orphans of cancelled subtrees are reaped here too, they do not belong to any variable.
+        if (trees->pids[slot] == 0) {
+            continue;
+        }
+
+        unsigned int var_index = trees->pid_variables[slot];
+
+        --trees->running;
+
+        /// Trees reading the variable would wait for it forever, the whole line fails instead.
+        if (trees->states[var_index] == TREE_RUNNING && (WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0)) {
+            fatal("Tree of x[%u] ended without a value\n", var_index);
+        }
+
+        /// Finished tree has taken every value it needed.
+        if (trees->states[var_index] == TREE_RUNNING) {
+            release_dependencies(trees, dependency_graph, active_circuits, var_index);
+        }
+
+        if (options == 0) {
+            return;
+        }
+    }
+
+    if (pid == -1 && errno != ECHILD) {
+        syserr("Error in wait\n");
+    }
+}
+
+void close_line_trees(ltrees *trees) {
+    free(trees->states);
+    free(trees->groups);
+    free(trees->needed);
+    free(trees->released);
+    free(trees->pids);
+    free(trees->pid_variables);
+}
+
+void open_line_pipes(lpipes *pipes, const ddag *dependency_graph, const ovariables *outputs,
+                     const int *active_circuits, const long *variables_values) {
+    unsigned int variables_count = dependency_graph->variables_count;
+
+    pipes->fds = malloc(variables_count * sizeof(*pipes->fds));
+    pipes->users = calloc(variables_count, sizeof(unsigned int));
+    pipes->open = malloc(variables_count * sizeof(unsigned int));
+    pipes->positions = calloc(variables_count, sizeof(unsigned int));
+    pipes->open_count = 0;
+
+    for (unsigned int v = 0; v < variables_count; ++v) {
+        if (active_circuits[v] != ACTIVE) {
+            continue;
+        }
+
+        ++pipes->users[v];
+
+        for (unsigned int e = dependency_graph->dependency_offsets[v];
+             e < dependency_graph->dependency_offsets[v + 1]; ++e) {
+            ++pipes->users[dependency_graph->dependency_targets[e]];
+        }
+    }
+
+    /// Outputs are read by the line itself after all trees have finished.
+    for (unsigned int i = 0; i < outputs->count; ++i) {
+        unsigned int var_index = outputs->indices[i];
+
+        if (active_circuits[var_index] != 0) {
+            ++pipes->users[var_index];
+            acquire_line_pipe(pipes, var_index, active_circuits, variables_values);
+        }
+    }
+}
+
+int line_pipe_open(const lpipes *pipes, unsigned int var_index) {
+    unsigned int position = pipes->positions[var_index];
+
+    return position < pipes->open_count && pipes->open[position] == var_index;
+}
+
+void acquire_line_pipe(lpipes *pipes, unsigned int var_index, const int *active_circuits,
+                       const long *variables_values) {
+    if (line_pipe_open(pipes, var_index)) {
+        return;
+    }
+
+    if (pipe(pipes->fds[var_index]) == -1) {
+        syserr("Error in pipe\n");
+    }
+
+    pipes->positions[var_index] = pipes->open_count;
+    pipes->open[pipes->open_count++] = var_index;
+
+    if (active_circuits[var_index] == LEAF) {
+        put_val_into_pipe((int) var_index, variables_values, pipes->fds);
+    }
+}
+
+void release_line_pipe(lpipes *pipes, unsigned int var_index) {
+    /// Trees which are never started release buffers nobody has opened yet.
+    if (--pipes->users[var_index] > 0 || line_pipe_open(pipes, var_index) == 0) {
+        return;
+    }
+
+    /// Value stays in the buffer for the trees which hold it.
+    if (close(pipes->fds[var_index][0]) == -1 || close(pipes->fds[var_index][1]) == -1) {
+        syserr("Error while closing pipe\n");
+    }
+
+    unsigned int position = pipes->positions[var_index];
+    unsigned int last = pipes->open[--pipes->open_count];
+
+    pipes->open[position] = last;
+    pipes->positions[last] = position;
+}
+
+void acquire_tree_pipes(lpipes *pipes, const ddag *dependency_graph, unsigned int var_index,
+                        const int *active_circuits, const long *variables_values) {
+    acquire_line_pipe(pipes, var_index, active_circuits, variables_values);
+
+    for (unsigned int e = dependency_graph->dependency_offsets[var_index];
+         e < dependency_graph->dependency_offsets[var_index + 1]; ++e) {
+        acquire_line_pipe(pipes, dependency_graph->dependency_targets[e], active_circuits, variables_values);
+    }
+}
+
+void release_tree_pipes(lpipes *pipes, const ddag *dependency_graph, unsigned int var_index) {
+    release_line_pipe(pipes, var_index);
+
+    for (unsigned int e = dependency_graph->dependency_offsets[var_index];
+         e < dependency_graph->dependency_offsets[var_index + 1]; ++e) {
+        release_line_pipe(pipes, dependency_graph->dependency_targets[e]);
+    }
+}
+
+void keep_tree_pipes(lpipes *pipes, const ddag *dependency_graph, unsigned int var_index) {
+    unsigned int first = dependency_graph->dependency_offsets[var_index];
+    unsigned int last = dependency_graph->dependency_offsets[var_index + 1];
+    unsigned int kept = 0;
+
+    /// Buffers the tree uses are moved to the front of open, all the others are closed.
+    for (unsigned int e = first; e <= last; ++e) {
+        unsigned int v = e < last ? dependency_graph->dependency_targets[e] : var_index;
+        unsigned int position = pipes->positions[v];
+
+        if (position < kept) {
+            continue;
+        }
+
+        pipes->open[position] = pipes->open[kept];
+        pipes->positions[pipes->open[kept]] = position;
+        pipes->open[kept] = v;
+        pipes->positions[v] = kept++;
+    }
+
+    for (unsigned int i = kept; i < pipes->open_count; ++i) {
+        unsigned int v = pipes->open[i];
+
+        if (close(pipes->fds[v][0]) == -1 || close(pipes->fds[v][1]) == -1) {
             syserr("Error while closing pipe\n");
         }
-        if (close(var_pipes[v][1]) == -1) {
+    }
+
+    pipes->open_count = kept;
+}
+
+void close_line_pipes(lpipes *pipes) {
+    for (unsigned int i = 0; i < pipes->open_count; ++i) {
+        unsigned int v = pipes->open[i];
+
+        if (close(pipes->fds[v][0]) == -1 || close(pipes->fds[v][1]) == -1) {
             syserr("Error while closing pipe\n");
         }
     }
 
-    long result_val;
-    sscanf(result_string, "%ld", &result_val);
-    fprintf(stdout, "%d P %ld\n", equation_number, result_val);
-    fflush(stdout);
+    free(pipes->fds);
+    free(pipes->users);
+    free(pipes->open);
+    free(pipes->positions);
 }
 
 void put_val_into_pipe(const int var_index, const long *variables_values, int var_pipes[][2]) {
@@ -259,6 +743,9 @@ void put_val_into_pipe(const int var_index, const long *variables_values, int va
 }
 
 void spawn_tree(int var_index, dnode *variables, int var_pipes[][2]) {
+    tspan tree_span;
+    trace_begin(&tree_span, "variable", "x[%ld]", var_index);
+
     int pipe_down[2];
     if (pipe(pipe_down) == -1) {
         syserr("Error in pipe\n");
@@ -267,10 +754,12 @@ void spawn_tree(int var_index, dnode *variables, int var_pipes[][2]) {
     char var_value[BUFF_SIZE];
 
     enode *root = variables[var_index].expression;
+    pid_t parent = getpid();
     switch (fork()) {
         case -1:
             syserr("Error in fork\n");
         case 0:
+            bind_to_parent(parent);
             spawn_circuit_node(root, pipe_down, var_pipes);
             return;
         default:
@@ -278,9 +767,7 @@ void spawn_tree(int var_index, dnode *variables, int var_pipes[][2]) {
                 syserr("Error while closing pipe_down[1]\n");
             }
 
-            if (read(pipe_down[0], var_value, BUFF_SIZE) == -1) {
-                syserr("Error while reading\n");
-            }
+            read_value(pipe_down[0], var_value);
 
             if (close(pipe_down[0]) == -1) {
                 syserr("Error while closing pipe_down[0]\n");
@@ -293,54 +780,186 @@ void spawn_tree(int var_index, dnode *variables, int var_pipes[][2]) {
             if (wait(0) == -1) {
                 syserr("Error in wait\n");
             }
+
+            trace_end(&tree_span);
+    }
+}
+
+void spawn_circuit_node(enode *node, int pipe_up[2], int var_pipes[][2]) {
+    char var_value[BUFF_SIZE];
+    tspan node_span;
+    int node_pipe[2] = {pipe_up[0], pipe_up[1]};
+    int ret_code = 0;
+
+    /// A forked child carries on with its operand in this very frame, so deep circuits do not grow the stack.
+    while (ret_code == 0) {
+        trace_begin(&node_span, "node", node_trace_format(node), node->value);
+
+        if (close(node_pipe[0]) == -1) {
+            syserr("Error while closing pipe_up[0]\n");
+        }
+
+        ret_code = 1;
+
+        if (node->operation_code == VALUE_CODE) {
+            sprintf(var_value, "%ld", node->value);
+        } else if (node->operation_code == VARIABLE_CODE) {
+            spawn_variable_node(node, var_pipes, var_value);
+        } else if (node->operation_code == '-') {
+            ret_code = spawn_negate_node(node, var_pipes, var_value, &node, node_pipe);
+        } else if (node->operation_code == '*' || node->operation_code == '+') {
+            ret_code = spawn_binary_node(node, var_pipes, var_value, &node, node_pipe);
+        }
+    }
+
+    /// Writing results to pipe_up.
+    if (write(node_pipe[1], var_value, BUFF_SIZE) == -1) {
+        syserr("Error while writing %d\n", node->operation_code);
+    }
+
+    if (close(node_pipe[1]) == -1) {
+        syserr("Error while closing pipe_up[1]\n");
+    }
+
+    trace_end(&node_span);
+}
+
+const char *node_trace_format(const enode *node) {
+    if (node->operation_code == VALUE_CODE) {
+        return "%ld";
+    } else if (node->operation_code == VARIABLE_CODE) {
+        return "x[%ld]";
+    } else if (node->operation_code == '-') {
+        return "-";
+    } else if (node->operation_code == '*') {
+        return "*";
+    }
+    return "+";
+}
+
+void bind_to_parent(pid_t parent) {
+    /// Cancelling a subtree takes down every process below it, whatever group it is in.
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1) {
+        syserr("Error in prctl\n");
+    }
+
+    if (getppid() != parent) {
+        exit(1);
+    }
+}
+
+pid_t spawn_operand(enode *node, enode *operand, int pipe_down[2], enode **next_node, int next_pipe[2]) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+
+    switch (pid) {
+        case -1:
+            syserr("Error in fork\n");
+        case 0:
+            bind_to_parent(parent);
+            /// Multiplicands lead their own process group, so a sibling can cancel them at once.
+            if (node->operation_code == '*' && setpgid(0, 0) == -1) {
+                syserr("Error in setpgid\n");
+            }
+            /// Only the parent answers upwards, its write end would otherwise stay open all the way down.
+            if (close(next_pipe[1]) == -1) {
+                syserr("Error while closing pipe_up[1]\n");
+            }
+            *next_node = operand;
+            next_pipe[0] = pipe_down[0];
+            next_pipe[1] = pipe_down[1];
+            return 0;
+        default:
+            if (node->operation_code == '*' && setpgid(pid, pid) == -1 && errno != EACCES && errno != ESRCH) {
+                syserr("Error in setpgid\n");
+            }
+            if (close(pipe_down[1]) == -1) {
+                syserr("Error while closing pipe_down[1]\n");
+            }
+    }
+
+    return pid;
+}
+
+void read_value(int fd, char *value) {
+    ssize_t read_count = read(fd, value, BUFF_SIZE);
+
+    if (read_count == -1) {
+        syserr("Error while reading\n");
+    }
+
+    /// A descendant which failed closes its pipe without a value, the failure goes up the tree.
+    if (read_count != BUFF_SIZE) {
+        fatal("Process ended without a value\n");
+    }
+}
+
+long read_operand(int operand_fd) {
+    char val_string[BUFF_SIZE];
+    long val;
+
+    read_value(operand_fd, val_string);
+
+    if (close(operand_fd) == -1) {
+        syserr("Error while closing pipe_down[0]\n");
     }
-}
 
-void spawn_circuit_node(enode *node, int pipe_up[2], int var_pipes[][2]) {
-    char var_value[BUFF_SIZE];
+    sscanf(val_string, "%ld", &val);
 
-    if (close(pipe_up[0]) == -1) {
-        syserr("Error while closing pipe_up[0]\n");
-    }
+    return val;
+}
 
-    int ret_code = 1;
+long multiply_operands(int pipe_down_left[2], int pipe_down_right[2], pid_t pids[2]) {
+    struct pollfd operands[2];
+    long res_val = 1;
+    int remaining = 2;
 
-    if (node->operation_code == VALUE_CODE) {
-        sprintf(var_value, "%ld", node->value);
-    } else if (node->operation_code == VARIABLE_CODE) {
-        spawn_variable_node(node, var_pipes, var_value);
-    } else if (node->operation_code == '-') {
-        ret_code = spawn_negate_node(node, var_pipes, var_value);
-    } else if (node->operation_code == '*' || node->operation_code == '+') {
-        ret_code = spawn_binary_node(node, var_pipes, var_value);
-    }
+    operands[0].fd = pipe_down_left[0];
+    operands[1].fd = pipe_down_right[0];
+    operands[0].events = operands[1].events = POLLIN;
 
-    if (ret_code == 1) {
-        /// Writing results to pipe_up.
-        if (write(pipe_up[1], var_value, BUFF_SIZE) == -1) {
-            syserr("Error while writing %d\n", node->operation_code);
+    /// Whichever multiplicand comes first may already decide the result.
+    while (remaining > 0) {
+        if (poll(operands, 2, -1) == -1) {
+            syserr("Error in poll\n");
         }
 
-        if (close(pipe_up[1]) == -1) {
-            syserr("Error while closing pipe_up[1]\n");
+        for (int i = 0; i < 2; ++i) {
+            if (operands[i].fd == -1 || operands[i].revents == 0) {
+                continue;
+            }
+
+            long val = read_operand(operands[i].fd);
+
+            operands[i].fd = -1;
+            --remaining;
+            res_val *= val;
+
+            if (val == 0 && remaining > 0) {
+                if (killpg(pids[1 - i], SIGTERM) == -1 && errno != ESRCH) {
+                    syserr("Error in killpg\n");
+                }
+                if (close(operands[1 - i].fd) == -1) {
+                    syserr("Error while closing pipe_down[0]\n");
+                }
+                return 0;
+            }
         }
     }
 
+    return res_val;
 }
 
-int spawn_binary_node(enode *node, int var_pipes[][2], char *var_string) {
+int spawn_binary_node(enode *node, int var_pipes[][2], char *var_string, enode **next_node, int next_pipe[2]) {
+    pid_t pids[2];
+
     int pipe_down_left[2];
     if (pipe(pipe_down_left) == -1) {
         syserr("Error in pipe\n");
     }
 
-    switch (fork()) {
-        case -1:
-            syserr("Error in fork\n");
-        case 0:
-            spawn_circuit_node(node->left_son, pipe_down_left, var_pipes);
-            return 0;
-        default:;
+    if ((pids[0] = spawn_operand(node, node->left_son, pipe_down_left, next_node, next_pipe)) == 0) {
+        return 0;
     }
 
     int pipe_down_right[2];
@@ -348,61 +967,36 @@ int spawn_binary_node(enode *node, int var_pipes[][2], char *var_string) {
         syserr("Error in pipe\n");
     }
 
-    switch (fork()) {
-        case -1:
-            syserr("Error in fork\n");
-        case 0:
-            spawn_circuit_node(node->right_son, pipe_down_right, var_pipes);
-            return 0;
-        default:;
-    }
-
-    char left_val_string[BUFF_SIZE];
-
-    if (read(pipe_down_left[0], left_val_string, BUFF_SIZE) == -1) {
-        syserr("Error while reading dddd\n");
-    }
-
-    if (close(pipe_down_left[0]) == -1) {
-        syserr("Error while closing pipe_down[0]\n");
-    }
-
-    long left_val;
-    sscanf(left_val_string, "%ld", &left_val);
-
-    char right_val_string[BUFF_SIZE];
-
-    if (read(pipe_down_right[0], right_val_string, BUFF_SIZE) == -1) {
-        syserr("Error while reading\n");
-    }
-
-    if (close(pipe_down_right[0]) == -1) {
-        syserr("Error while closing pipe_down[0]\n");
+    if ((pids[1] = spawn_operand(node, node->right_son, pipe_down_right, next_node, next_pipe)) == 0) {
+        /// The left operand's result is read by the parent alone.
+        if (close(pipe_down_left[0]) == -1) {
+            syserr("Error while closing pipe_down[0]\n");
+        }
+        return 0;
     }
 
-    long right_val;
-    sscanf(right_val_string, "%ld", &right_val);
-
     long res_val;
 
     if (node->operation_code == '*') {
-        res_val = left_val * right_val;
+        res_val = multiply_operands(pipe_down_left, pipe_down_right, pids);
     } else {
-        res_val = left_val + right_val;
+        res_val = read_operand(pipe_down_left[0]) + read_operand(pipe_down_right[0]);
     }
 
     sprintf(var_string, "%ld", res_val);
 
-    if (wait(0) == -1)
-        syserr("Error in wait\n");
-
-    if (wait(0) == -1)
-        syserr("Error in wait\n");
+    for (int i = 0; i < 2; ++i) {
+        if (waitpid(pids[i], NULL, 0) == -1) {
+            syserr("Error in wait\n");
+        }
+    }
 
     return 1;
 }
 
-int spawn_negate_node(const enode *node, int var_pipes[][2], char *var_string) {
+int spawn_negate_node(const enode *node, int var_pipes[][2], char *var_string, enode **next_node,
+                      int next_pipe[2]) {
+    pid_t parent = getpid();
     int pipe_down[2];
     if (pipe(pipe_down) == -1) {
         syserr("Error in pipe\n");
@@ -412,16 +1006,20 @@ int spawn_negate_node(const enode *node, int var_pipes[][2], char *var_string) {
         case -1:
             syserr("Error in fork\n");
         case 0:
-            spawn_circuit_node(node->left_son, pipe_down, var_pipes);
+            bind_to_parent(parent);
+            if (close(next_pipe[1]) == -1) {
+                syserr("Error while closing pipe_up[1]\n");
+            }
+            *next_node = node->left_son;
+            next_pipe[0] = pipe_down[0];
+            next_pipe[1] = pipe_down[1];
             return 0;
         default:
             if (close(pipe_down[1]) == -1) {
                 syserr("Error while closing pipe_down[1]\n");
             }
 
-            if (read(pipe_down[0], var_string, BUFF_SIZE) == -1) {
-                syserr("Error while reading\n");
-            }
+            read_value(pipe_down[0], var_string);
 
             if (close(pipe_down[0]) == -1) {
                 syserr("Error while closing pipe_down[0]\n");
@@ -444,6 +1042,27 @@ int spawn_negate_node(const enode *node, int var_pipes[][2], char *var_string) {
 
 void spawn_variable_node(const enode *node, int var_pipes[][2], char *var_value) {
     long var_index = node->value;
+    struct pollfd variable;
+    sigset_t cancel_signals;
+    sigset_t previous_signals;
+
+    tspan wait_span;
+
+    variable.fd = var_pipes[var_index][0];
+    variable.events = POLLIN;
+
+    trace_begin(&wait_span, "wait", "wait x[%ld]", var_index);
+
+    /// Waiting stays cancellable, only taking the value out and putting it back is not.
+    if (poll(&variable, 1, -1) == -1) {
+        syserr("Error in poll\n");
+    }
+
+    sigemptyset(&cancel_signals);
+    sigaddset(&cancel_signals, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &cancel_signals, &previous_signals) == -1) {
+        syserr("Error in sigprocmask\n");
+    }
 
     if (read(var_pipes[var_index][0], var_value, BUFF_SIZE) == -1) {
         syserr("Error while reading\n");
@@ -453,131 +1072,462 @@ void spawn_variable_node(const enode *node, int var_pipes[][2], char *var_value)
     if (write(var_pipes[var_index][1], var_value, BUFF_SIZE) == -1) {
         syserr("Error while writing\n");
     }
+
+    if (sigprocmask(SIG_SETMASK, &previous_signals, NULL) == -1) {
+        syserr("Error in sigprocmask\n");
+    }
+
+    trace_end(&wait_span);
+}
+
+void open_input_lines(ilines *input) {
+    input->buffer = NULL;
+    input->start = 0;
+    input->length = 0;
+    input->capacity = 0;
+    input->closed = 0;
+}
+
+void fill_input_lines(ilines *input) {
+    /// Lines already handed out are dropped before reading more.
+    input->length -= input->start;
+    memmove(input->buffer, input->buffer + input->start, input->length);
+    input->start = 0;
+
+    /// Long lines double the buffer, so they are not read and searched again chunk by chunk.
+    if (input->capacity - input->length < INPUT_READ_SIZE + 1) {
+        input->capacity = input->capacity * 2 > input->length + INPUT_READ_SIZE + 1
+                          ? input->capacity * 2 : input->length + INPUT_READ_SIZE + 1;
+        input->buffer = realloc(input->buffer, input->capacity);
+    }
+
+    ssize_t read_count = read(STDIN_FILENO, input->buffer + input->length, input->capacity - input->length - 1);
+
+    if (read_count == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        syserr("Error while reading\n");
+    }
+
+    input->length += read_count;
+
+    if (read_count == 0) {
+        input->closed = 1;
+
+        /// Last line does not need a newline once the input ends.
+        if (input->length > 0 && input->buffer[input->length - 1] != '\n') {
+            input->buffer[input->length++] = '\n';
+        }
+    }
+}
+
+char *next_input_line(ilines *input) {
+    if (input->start == input->length) {
+        return NULL;
+    }
+
+    char *line = input->buffer + input->start;
+    char *line_end = memchr(line, '\n', input->length - input->start);
+
+    if (line_end == NULL) {
+        return NULL;
+    }
+
+    *line_end = 0;
+    input->start = line_end + 1 - input->buffer;
+
+    return line;
 }
 
-int read_resolve_initialization(ddag *dependency_graph,
-                                int *variables_initialized,
-                                int *active_circuits,
-                                long *variables_values,
-                                int *equation_number) {
-    char *expression = NULL;
-    char *to_release;
-    size_t len = 0;
-    size_t expression_length;
-    ssize_t read;
+char *wait_input_line(ilines *input) {
+    char *line;
 
-    read = getline(&expression, &len, stdin);
+    while ((line = next_input_line(input)) == NULL && input->closed == 0) {
+        fill_input_lines(input);
+    }
 
-    to_release = expression;
+    return line;
+}
 
-    expression_length = (size_t) read;
-    expression[expression_length - 1] = 0;
+void close_input_lines(ilines *input) {
+    free(input->buffer);
+}
 
+int resolve_initialization(ddag *dependency_graph,
+                           const ovariables *outputs,
+                           const char *expression,
+                           int *variables_initialized,
+                           int *active_circuits,
+                           long *variables_values,
+                           int *outputs_solvable,
+                           int *equation_number) {
     int chars_read;
-    sscanf(expression, "%d %n", equation_number, &chars_read);
+    if (sscanf(expression, "%d %n", equation_number, &chars_read) != 1) {
+        return -1;
+    }
 
     expression += chars_read;
 
     unsigned int var_index;
     long var_value;
-    while (sscanf(expression, "x[%u] %ld %n", &var_index, &var_value, &chars_read) == 2) {
+    while (sscanf(expression, "x[%u] %ld %n", &var_index, &var_value, &chars_read) == 2
+           && var_index < dependency_graph->variables_count) {
         variables_initialized[var_index] = 1;
         variables_values[var_index] = var_value;
         expression += chars_read;
     }
 
-    free(to_release);
-
-    return is_circuit_solvable(dependency_graph, variables_initialized, active_circuits);
+    return is_circuit_solvable(dependency_graph, outputs, variables_initialized, active_circuits, outputs_solvable);
 }
 
-int is_circuit_solvable(ddag *dependency_graph, int variables_initialized[], int active_variables[]) {
-    dnode *root = dependency_graph->variables;
+int is_circuit_solvable(ddag *dependency_graph, const ovariables *outputs, int variables_initialized[],
+                        int active_variables[], int outputs_solvable[]) {
+    unsigned int solvable_count = 0;
+
+    if (dependency_graph->reachability != NULL) {
+        return bitsets_is_solvable(dependency_graph, outputs, variables_initialized, active_variables,
+                                   outputs_solvable);
+    }
+
+    /// Outputs share active_variables, so a subcircuit is checked once for all of them.
+    for (unsigned int i = 0; i < outputs->count; ++i) {
+        outputs_solvable[i] = dfs_is_solvable(outputs->indices[i], dependency_graph, variables_initialized,
+                                              active_variables);
+        solvable_count += outputs_solvable[i];
+    }
+
+    retain_needed_variables(dependency_graph, outputs, outputs_solvable, active_variables);
 
-    return dfs_is_solvable(root, dependency_graph->variables, variables_initialized, active_variables);
+    return solvable_count;
 }
 
-int dfs_is_solvable(dnode *v, dnode *variables, int *variables_initialized, int *active_variables) {
-    int variable_index = v->variable_index;
+int variable_status(unsigned int v, ddag *dependency_graph, int *variables_initialized, int *active_variables) {
+    if (active_variables[v] == UNSOLVABLE) {
+        return 0;
+    }
+
+    if (active_variables[v] != 0) {
+        return 1; /// Already reached through another path.
+    }
 
-    if (variables_initialized[variable_index] == 1) {
-        active_variables[variable_index] = LEAF;
+    if (variables_initialized[v] == 1) {
+        active_variables[v] = LEAF;
         return 1;
     }
 
-    if (variables[variable_index].expression == NULL) {
+    if (dependency_graph->variables[v].expression == NULL) {
+        active_variables[v] = UNSOLVABLE;
         return 0;
     }
 
-    for (dlist *var = variables[variable_index].dependent_variables; var != NULL; var = var->next) {
-        if (dfs_is_solvable(var->variable, variables, variables_initialized, active_variables) == 0) {
-            return 0;
+    return -1;
+}
+
+int dfs_is_solvable(unsigned int v, ddag *dependency_graph, int *variables_initialized, int *active_variables) {
+    int status = variable_status(v, dependency_graph, variables_initialized, active_variables);
+
+    if (status != -1) {
+        return status;
+    }
+
+    /// Path from v is kept on a heap stack, each vertex with the next dependency to check.
+    unsigned int *path = malloc(dependency_graph->variables_count * sizeof(unsigned int));
+    unsigned int *next_edge = malloc(dependency_graph->variables_count * sizeof(unsigned int));
+    unsigned int path_length = 0;
+    int is_solvable = 1;
+
+    path[path_length] = v;
+    next_edge[path_length++] = dependency_graph->dependency_offsets[v];
+
+    while (path_length > 0) {
+        unsigned int top = path[path_length - 1];
+
+        if (next_edge[path_length - 1] == dependency_graph->dependency_offsets[top + 1]) {
+            active_variables[top] = ACTIVE;
+            --path_length;
+            continue;
+        }
+
+        unsigned int u = dependency_graph->dependency_targets[next_edge[path_length - 1]++];
+        status = variable_status(u, dependency_graph, variables_initialized, active_variables);
+
+        if (status == 0) {
+            /// Every variable on the path depends on the unsolvable one.
+            while (path_length > 0) {
+                active_variables[path[--path_length]] = UNSOLVABLE;
+            }
+            is_solvable = 0;
+        } else if (status == -1) {
+            path[path_length] = u;
+            next_edge[path_length++] = dependency_graph->dependency_offsets[u];
         }
     }
 
-    active_variables[variable_index] = ACTIVE;
-    return 1;
+    free(path);
+    free(next_edge);
+
+    return is_solvable;
 }
 
-int is_cycled(ddag *dependency_graph) {
-    unsigned int vertices_number = dependency_graph->variables_count;
-    unsigned int vertex_visited[vertices_number];
+void retain_needed_variables(ddag *dependency_graph, const ovariables *outputs, const int *outputs_solvable,
+                             int *active_variables) {
+    unsigned int variables_count = dependency_graph->variables_count;
+    int *needed = calloc(variables_count, sizeof(int));
+    unsigned int *stack = malloc(variables_count * sizeof(unsigned int));
+    unsigned int stack_size = 0;
+
+    /// Variables checked only on behalf of unsolvable outputs are not worth spawning.
+    for (unsigned int i = 0; i < outputs->count; ++i) {
+        unsigned int root = outputs->indices[i];
+
+        if (outputs_solvable[i] == 1 && needed[root] == 0) {
+            needed[root] = 1;
+            stack[stack_size++] = root;
+        }
+    }
+
+    while (stack_size > 0) {
+        unsigned int v = stack[--stack_size];
+
+        if (active_variables[v] == LEAF) {
+            continue;
+        }
 
-    memset(vertex_visited, 0, sizeof(vertex_visited));
+        for (unsigned int e = dependency_graph->dependency_offsets[v]; e < dependency_graph->dependency_offsets[v + 1]; ++e) {
+            unsigned int u = dependency_graph->dependency_targets[e];
 
-    for (int v = 0; v < vertices_number; ++v) {
-        if (vertex_visited[v] == 0) {
-            if (dfs_cycle_search(v, dependency_graph->variables, vertex_visited) == 1) {
-                return 1;
+            if (needed[u] == 0) {
+                needed[u] = 1;
+                stack[stack_size++] = u;
             }
         }
     }
 
-    return 0;
+    for (unsigned int v = 0; v < variables_count; ++v) {
+        if (needed[v] == 0) {
+            active_variables[v] = 0;
+        }
+    }
+
+    free(needed);
+    free(stack);
 }
 
-int dfs_cycle_search(int v, dnode *vertices, unsigned int vertices_visited[]) {
-    vertices_visited[v] = 1;
+int bitsets_is_solvable(ddag *dependency_graph, const ovariables *outputs, int *variables_initialized,
+                        int *active_variables, int *outputs_solvable) {
+    unsigned int variables_count = dependency_graph->variables_count;
+    unsigned int words = dependency_graph->bitset_words;
+    unsigned long *initialized = calloc(words, sizeof(unsigned long));
+    unsigned long *active = calloc(words, sizeof(unsigned long));
+    unsigned long *reached = malloc(words * sizeof(unsigned long));
+    unsigned int *stack = malloc(variables_count * sizeof(unsigned int));
+    unsigned int solvable_count = 0;
+
+    for (unsigned int v = 0; v < variables_count; ++v) {
+        if (variables_initialized[v] == 1) {
+            initialized[v / WORD_BITS] |= 1UL << (v % WORD_BITS);
+        }
+    }
+
+    for (unsigned int i = 0; i < outputs->count; ++i) {
+        unsigned int root = outputs->indices[i];
+        unsigned int stack_size = 0;
+
+        outputs_solvable[i] = 0;
+
+        /// Output lies inside the subcircuit of an already solvable one.
+        if (active[root / WORD_BITS] & (1UL << (root % WORD_BITS))) {
+            outputs_solvable[i] = 1;
+            ++solvable_count;
+            continue;
+        }
+
+        memset(reached, 0, words * sizeof(unsigned long));
+        reached[root / WORD_BITS] |= 1UL << (root % WORD_BITS);
+        stack[stack_size++] = root;
+
+        while (stack_size > 0) {
+            unsigned int v = stack[--stack_size];
+            unsigned long *row = dependency_graph->reachability + (size_t) v * words;
+            unsigned long blocked = 0;
+
+            if (variables_initialized[v] == 1 || (active[v / WORD_BITS] & (1UL << (v % WORD_BITS)))) {
+                continue;
+            }
+
+            for (unsigned int w = 0; w < words; ++w) {
+                blocked |= row[w] & initialized[w];
+            }
+
+            /// Without initialized variables below, everything reachable takes part in evaluation.
+            if (blocked == 0) {
+                for (unsigned int w = 0; w < words; ++w) {
+                    reached[w] |= row[w];
+                }
+                continue;
+            }
+
+            for (unsigned int e = dependency_graph->dependency_offsets[v];
+                 e < dependency_graph->dependency_offsets[v + 1]; ++e) {
+                unsigned int u = dependency_graph->dependency_targets[e];
 
-    for (dlist *var = vertices[v].dependent_variables; var != NULL; var = var->next) {
-        int var_index = var->variable->variable_index;
-        if (vertices_visited[var_index] == 1) {
-            return 1;
-        } else if (dfs_cycle_search(var_index, vertices, vertices_visited) == 1) {
-            return 1;
+                if ((reached[u / WORD_BITS] & (1UL << (u % WORD_BITS))) == 0) {
+                    reached[u / WORD_BITS] |= 1UL << (u % WORD_BITS);
+                    stack[stack_size++] = u;
+                }
+            }
+        }
+
+        outputs_solvable[i] = 1;
+        for (unsigned int w = 0; w < words; ++w) {
+            if ((reached[w] & ~initialized[w] & ~dependency_graph->defined[w]) != 0) {
+                outputs_solvable[i] = 0;
+            }
+        }
+
+        if (outputs_solvable[i] == 1) {
+            for (unsigned int w = 0; w < words; ++w) {
+                active[w] |= reached[w];
+            }
+            ++solvable_count;
+        }
+    }
+
+    for (unsigned int v = 0; v < variables_count; ++v) {
+        if (active[v / WORD_BITS] & (1UL << (v % WORD_BITS))) {
+            active_variables[v] = variables_initialized[v] == 1 ? LEAF : ACTIVE;
         }
     }
 
-    vertices_visited[v] = 0;
+    free(initialized);
+    free(active);
+    free(reached);
+    free(stack);
 
-    return 0;
+    return solvable_count;
+}
+
+unsigned int topological_sort(ddag *dependency_graph, unsigned int equations_limit, unsigned int *order) {
+    unsigned int vertices_number = dependency_graph->variables_count;
+    dnode *vertices = dependency_graph->variables;
+    unsigned int *dependencies_left = calloc(vertices_number, sizeof(unsigned int));
+    unsigned int sorted_count = 0;
+    unsigned int visited_count = 0;
+
+    /// Only equations placed before equations_limit contribute their edges.
+    for (unsigned int v = 0; v < vertices_number; ++v) {
+        if (vertices[v].equation_index < equations_limit) {
+            dependencies_left[v] = dependency_graph->dependency_offsets[v + 1] - dependency_graph->dependency_offsets[v];
+        }
+
+        if (dependencies_left[v] == 0) {
+            order[sorted_count++] = v;
+        }
+    }
+
+    /// Kahn's algorithm over reverse edges, order doubles as the queue.
+    while (visited_count < sorted_count) {
+        unsigned int u = order[visited_count++];
+
+        for (unsigned int e = dependency_graph->dependent_offsets[u]; e < dependency_graph->dependent_offsets[u + 1]; ++e) {
+            unsigned int v = dependency_graph->dependent_targets[e];
+
+            if (vertices[v].equation_index < equations_limit && --dependencies_left[v] == 0) {
+                order[sorted_count++] = v;
+            }
+        }
+    }
+
+    free(dependencies_left);
+
+    return sorted_count;
+}
+
+int is_cycled(ddag *dependency_graph, unsigned int equations_limit) {
+    unsigned int *order = malloc(dependency_graph->variables_count * sizeof(unsigned int));
+    unsigned int sorted_count = topological_sort(dependency_graph, equations_limit, order);
+
+    free(order);
+
+    /// Every vertex left unsorted lies on a cycle or depends on one.
+    return sorted_count != dependency_graph->variables_count;
+}
+
+unsigned int find_cycle_closing_equation(ddag *dependency_graph, unsigned int equations_count) {
+    if (is_cycled(dependency_graph, equations_count) == 0) {
+        return NO_EQUATION;
+    }
+
+    /// Adding equations never removes a cycle, so the first one closing it can be bisected.
+    unsigned int acyclic_prefix = 0;
+    unsigned int cyclic_prefix = equations_count;
+
+    while (cyclic_prefix - acyclic_prefix > 1) {
+        unsigned int middle = acyclic_prefix + (cyclic_prefix - acyclic_prefix) / 2;
+
+        if (is_cycled(dependency_graph, middle) == 1) {
+            cyclic_prefix = middle;
+        } else {
+            acyclic_prefix = middle;
+        }
+    }
+
+    return cyclic_prefix - 1;
 }
 
-int read_parse_equation(unsigned int variables_count, ddag *dependency_graph) {
-    char *expression = NULL;
-    char *to_release;
-    size_t len = 0;
-    size_t expression_length;
-    ssize_t read;
+void read_equations(ilines *input, unsigned int equations_count, unsigned int *equations_numbers, char **lines) {
+    for (unsigned int i = 0; i < equations_count; ++i) {
+        char *line;
+        int offset = 0;
 
-    read = getline(&expression, &len, stdin);
+        /// Blank lines are skipped, as whitespace before an equation number always was.
+        do {
+            if ((line = wait_input_line(input)) == NULL) {
+                fatal("Input ended after %u of %u equations\n", i, equations_count);
+            }
+        } while (line[strspn(line, " \t\r")] == 0);
+
+        equations_numbers[i] = 0;
+        sscanf(line, "%u %n", &equations_numbers[i], &offset);
 
-    to_release = expression;
+        lines[i] = strdup(line + offset);
+    }
+}
 
-    expression_length = (size_t) read;
-    expression[expression_length - 1] = 0;
+void parse_output_variables(char *list, ovariables *outputs) {
+    char *end;
 
-    int ret_val = parse_single_equation(expression, expression_length, dependency_graph, variables_count);
+    outputs->count = 0;
+    outputs->indices = malloc((strlen(list) / 2 + 1) * sizeof(unsigned int));
 
-    free(to_release);
+    /// Comma separated variable indices, e.g. "0,3,5".
+    do {
+        outputs->indices[outputs->count++] = (unsigned int) strtoul(list, &end, 10);
+        if (end == list) {
+            fatal("Invalid list of output variables");
+        }
+        list = end + 1;
+    } while (*end == ',');
 
-    return ret_val;
+    if (*end != 0) {
+        fatal("Invalid list of output variables");
+    }
 }
 
 ddag *initialize_dependency_graph(unsigned int variables_count) {
     ddag *dag = malloc(sizeof(ddag));
     dag->variables = malloc(variables_count * sizeof(dnode));
     dag->variables_count = variables_count;
+    dag->arenas = NULL;
+    dag->arenas_count = 0;
+    dag->dependency_offsets = NULL;
+    dag->dependency_targets = NULL;
+    dag->dependent_offsets = NULL;
+    dag->dependent_targets = NULL;
+    dag->reachability = NULL;
+    dag->defined = NULL;
+    dag->bitset_words = 0;
     set_variables(variables_count, dag->variables);
 
     return dag;
@@ -586,94 +1536,294 @@ ddag *initialize_dependency_graph(unsigned int variables_count) {
 void set_variables(unsigned int variables_count, dnode *variables) {
     for (int i = 0; i < variables_count; ++i) {
         variables[i].variable_index = i;
-        variables[i].dependent_variables = NULL;
+        variables[i].equation_index = NO_EQUATION;
         variables[i].expression = NULL;
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     unsigned int rows_number;
     unsigned int circuit_equations_number;
     unsigned int variables_count;
     unsigned int initial_values_to_process;
+    int completion_order = 0;
+    long threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+    ovariables outputs;
+    char *socket_path = NULL;
+    char *trace_path = NULL;
+    int option;
+
+    outputs.indices = NULL;
+
+    while ((option = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (option) {
+            case 'u':
+                completion_order = 1; /// Results are printed as soon as they are known.
+                break;
+            case 'j':
+                threads_count = strtol(optarg, NULL, 10); /// Threads used for parsing equations.
+                break;
+            case 'o':
+                free(outputs.indices);
+                parse_output_variables(optarg, &outputs);
+                break;
+            case 's':
+                socket_path = optarg; /// Serving initialization lists over a Unix socket.
+                break;
+            case 't':
+                trace_path = optarg; /// Chrome trace of the evaluation written on exit.
+                break;
+            default:
+                fatal("Usage: %s [-u] [-j threads] [-o outputs] [-s socket] [-t trace]", argv[0]);
+        }
+    }
+
+    if (trace_path != NULL) {
+        trace_open(TRACE_CAPACITY);
+    }
+
+    int outputs_requested = outputs.indices != NULL;
+
+    if (outputs.indices == NULL) {
+        outputs.indices = malloc(sizeof(unsigned int));
+        outputs.indices[0] = 0;
+        outputs.count = 1;
+    }
+
+    if (threads_count < 1) {
+        threads_count = 1;
+    }
 
-    scanf("%u %u %u\n", &rows_number, &circuit_equations_number, &variables_count);
+    ilines input;
+    open_input_lines(&input);
+
+    char *header = wait_input_line(&input);
+    if (header == NULL || sscanf(header, "%u %u %u", &rows_number, &circuit_equations_number, &variables_count) != 3) {
+        fatal("Missing circuit header\n");
+    }
+
+    for (unsigned int i = 0; i < outputs.count; ++i) {
+        if (outputs.indices[i] >= variables_count) {
+            fatal("Output variable x[%u] out of range", outputs.indices[i]);
+        }
+    }
 
     initial_values_to_process = rows_number - circuit_equations_number;
 
     ddag *dependency_graph = initialize_dependency_graph(variables_count);
 
-    for (int i = 0; i < circuit_equations_number; ++i) {
-        unsigned int equation_number;
-        scanf("%u ", &equation_number);
+    unsigned int *equations_numbers = malloc(circuit_equations_number * sizeof(unsigned int));
+    char **lines = malloc(circuit_equations_number * sizeof(char *));
+    pequation *equations = malloc(circuit_equations_number * sizeof(pequation));
 
-        if (read_parse_equation(variables_count, dependency_graph) == -1) {
-            fprintf(stdout, "%d F\n", equation_number);
-            fflush(stdout);
-            release_memory(dependency_graph);
-            return 42;
-        }
+    read_equations(&input, circuit_equations_number, equations_numbers, lines);
+    parse_equations(dependency_graph, lines, equations, circuit_equations_number, threads_count);
+
+    unsigned int merged_count = merge_equations(dependency_graph, equations, circuit_equations_number);
+    unsigned int failed_equation = find_cycle_closing_equation(dependency_graph, merged_count);
+
+    if (failed_equation == NO_EQUATION && merged_count < circuit_equations_number) {
+        failed_equation = merged_count;
+    }
 
-        if (is_cycled(dependency_graph) == 1) {
-            fprintf(stdout, "%d F\n", equation_number);
+    for (unsigned int i = 0; i < circuit_equations_number; ++i) {
+        free(lines[i]);
+    }
+    free(lines);
+    free(equations);
+
+    for (unsigned int i = 0; i < circuit_equations_number; ++i) {
+        if (i == failed_equation) {
+            fprintf(stdout, "%d F\n", equations_numbers[i]);
             fflush(stdout);
+            free(equations_numbers);
+            free(outputs.indices);
+            close_input_lines(&input);
             release_memory(dependency_graph);
             return 42;
         }
-        fprintf(stdout, "%d P\n", equation_number);
+        fprintf(stdout, "%d P\n", equations_numbers[i]);
         fflush(stdout);
     }
 
+    free(equations_numbers);
 
-    if (dependency_graph->variables[0].expression == NULL) {
+    compute_reachability(dependency_graph);
+
+    /// Requested outputs without an equation may still be initialized, each line reports them in its own column.
+    if (outputs_requested == 0 && dependency_graph->variables[0].expression == NULL) {
         fprintf(stdout, "%d F\n", circuit_equations_number + 1);
+        free(outputs.indices);
+        close_input_lines(&input);
         release_memory(dependency_graph);
         return 42;
     }
 
     fflush(stdout);
 
-    unsigned int valid_inputs = 0;
+    if (socket_path != NULL) {
+        serve_circuit(socket_path, dependency_graph, &outputs, completion_order);
+        if (trace_path != NULL) {
+            trace_write(trace_path);
+            trace_close();
+        }
+        close_input_lines(&input);
+        free(outputs.indices);
+        release_memory(dependency_graph);
+        return 0;
+    }
 
-    for (int i = 0; i < initial_values_to_process; ++i) {
-        int variables_initialized[variables_count];
-        int active_circuits[variables_count];
-        long variables_values[variables_count];
+    rchannel *results = open_result_channel();
+    wtable *workers = create_worker_table();
+    rbuffer *reorder_buffer = create_reorder_buffer(REORDER_INITIAL_LINES, outputs.count, completion_order,
+                                                    STDOUT_FILENO);
+    unsigned int pending_inputs = 0;
+
+    /// Per-line state lives on the heap, large circuits would not fit on the stack.
+    int *variables_initialized = malloc(variables_count * sizeof(int));
+    int *active_circuits = malloc(variables_count * sizeof(int));
+    long *variables_values = malloc(variables_count * sizeof(long));
+    int *outputs_solvable = malloc(outputs.count * sizeof(int));
+
+    unsigned int lines_started = 0;
+    sigset_t child_signals;
+    sigset_t original_signals;
+
+    /// Workers are reaped when they exit, even those which died before sending their results.
+    sigemptyset(&child_signals);
+    sigaddset(&child_signals, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &child_signals, &original_signals) == -1) {
+        syserr("Error in sigprocmask\n");
+    }
 
-        memset(variables_initialized, 0, sizeof(variables_initialized));
-        memset(active_circuits, 0, sizeof(active_circuits));
-        memset(variables_values, 0, sizeof(variables_values));
+    int child_fd = signalfd(-1, &child_signals, SFD_NONBLOCK);
+    if (child_fd == -1) {
+        syserr("Error in signalfd\n");
+    }
 
-        int equation_number;
-        int is_solvable = read_resolve_initialization(dependency_graph,
-                                                      variables_initialized,
-                                                      active_circuits,
-                                                      variables_values,
-                                                      &equation_number);
+    /// Lines are dispatched as they arrive, finished ones are collected while waiting for more input.
+    while (lines_started < initial_values_to_process || pending_inputs > 0) {
+        char *expression;
+
+        while (lines_started < initial_values_to_process && (expression = next_input_line(&input)) != NULL) {
+            memset(variables_initialized, 0, variables_count * sizeof(int));
+            memset(active_circuits, 0, variables_count * sizeof(int));
+            memset(variables_values, 0, variables_count * sizeof(long));
+
+            int equation_number;
+            int solvable_count = resolve_initialization(dependency_graph, &outputs, expression,
+                                                        variables_initialized, active_circuits, variables_values,
+                                                        outputs_solvable, &equation_number);
+
+            if (solvable_count > 0) {
+                rrecord line;
+                line.client = 0;
+                line.sequence = lines_started;
+                line.equation_number = equation_number;
+
+                pid_t worker = fork();
+
+                switch (worker) {
+                    case -1:
+                        syserr("Error in fork\n");
+                    case 0:
+                        if (close(child_fd) == -1) {
+                            syserr("Error while closing signalfd\n");
+                        }
+                        if (sigprocmask(SIG_SETMASK, &original_signals, NULL) == -1) {
+                            syserr("Error in sigprocmask\n");
+                        }
+                        detach_result_reader(results);
+                        process_single_input(variables_count, dependency_graph, &outputs, active_circuits,
+                                             variables_values, outputs_solvable, &line, results);
+                        return 1;
+                    default:
+                        add_worker(workers, worker, &line);
+                        ++pending_inputs;
+                }
+            } else {
+                store_failed_line(reorder_buffer, 0, lines_started, equation_number);
+            }
 
-        if (is_solvable == 1) {
-            switch (fork()) {
-                case -1:
-                    syserr("Error in fork\n");
-                case 0:
-                    process_single_input(variables_count, dependency_graph, active_circuits, variables_values,
-                                         equation_number);
-                    return 1;
-                default:
-                    ++valid_inputs;
+            ++lines_started;
+
+            /// Collecting whatever is already finished, so results are emitted while input is still read.
+            receive_results(results, &reorder_buffer, 0);
+        }
+
+        if (lines_started == initial_values_to_process && pending_inputs == 0) {
+            break;
+        }
+
+        if (lines_started < initial_values_to_process && input.closed) {
+            initial_values_to_process = lines_started; /// Input ended before every declared line arrived.
+            continue;
+        }
+
+        struct pollfd watched[4];
+
+        /// Stdin is read only once poll reports data, so it never has to be switched to non-blocking mode.
+        watched[0].fd = lines_started < initial_values_to_process ? STDIN_FILENO : -1;
+        watched[1].fd = results->pipe_fds[0];
+        watched[2].fd = child_fd;
+        watched[3].fd = reorder_buffer->output_length > 0 ? reorder_buffer->output_fd : -1;
+        watched[0].events = watched[1].events = watched[2].events = POLLIN;
+        watched[3].events = POLLOUT;
+
+        if (poll(watched, 4, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-        } else {
-            fprintf(stdout, "%d F\n", equation_number);
-            fflush(stdout);
+            syserr("Error in poll\n");
         }
-    }
 
-    for (int i = 0; i < valid_inputs; ++i) {
-        if (wait(0) == -1) {
-            syserr("Error in wait\n");
+        if (watched[0].revents != 0) {
+            fill_input_lines(&input);
+        }
+
+        if (watched[1].revents != 0) {
+            receive_results(results, &reorder_buffer, 0);
+        }
+
+        if (watched[2].revents != 0) {
+            struct signalfd_siginfo signal_info;
+
+            while (read(child_fd, &signal_info, sizeof(signal_info)) > 0) {
+            }
+
+            pending_inputs -= reap_workers(workers, results, &reorder_buffer);
+        }
+
+        if (watched[3].revents != 0) {
+            flush_output(reorder_buffer);
         }
     }
 
+    drain_output(reorder_buffer);
+
+    if (close(child_fd) == -1) {
+        syserr("Error while closing signalfd\n");
+    }
+
+    if (sigprocmask(SIG_SETMASK, &original_signals, NULL) == -1) {
+        syserr("Error in sigprocmask\n");
+    }
+
+    close_input_lines(&input);
+
+    if (trace_path != NULL) {
+        trace_write(trace_path);
+        trace_close();
+    }
+
+    free(variables_initialized);
+    free(active_circuits);
+    free(variables_values);
+    free(outputs_solvable);
+    close_result_channel(results);
+    release_worker_table(workers);
+    release_reorder_buffer(reorder_buffer);
+    free(outputs.indices);
     release_memory(dependency_graph);
 
     return 0;
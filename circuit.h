@@ -6,21 +6,51 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
 
 #include "circuit.h"
 #include "err.h"
+#include "results.h"
+#include "trace.h"
 
 #define VARIABLE_CODE   2137
 #define VALUE_CODE      1488
 
 #define ACTIVE          1
 #define LEAF            10
+#define UNSOLVABLE      (-1)
+
+#define TREE_PENDING    0
+#define TREE_RUNNING    1
+#define TREE_RELEASED   2
 #define BUFF_SIZE       64
 
+#define ARENA_CHUNK     4096
+#define PARSE_BATCH_MIN 256
+#define NO_EQUATION     ((unsigned int) -1)
+#define INPUT_READ_SIZE 4096
+
+#define REACHABILITY_MAX_VARIABLES  4096
+#define WORD_BITS                   (8 * sizeof(unsigned long))
+
+#define OPTIONS         "uj:o:s:t:"
+
 typedef struct enode enode;
 typedef struct dependency_dag_node dnode;
-typedef struct dependency_list dlist;
 typedef struct dependency_dag ddag;
+typedef struct expression_arena earena;
+typedef struct parse_context pcontext;
+typedef struct parsed_equation pequation;
+typedef struct parse_worker pworker;
+typedef struct output_variables ovariables;
+typedef struct input_lines ilines;
+typedef struct line_trees ltrees;
+typedef struct line_pipes lpipes;
 
 struct enode {
     int operation_code;
@@ -31,83 +61,233 @@ struct enode {
 
 struct dependency_dag_node {
     int variable_index;
-    dlist *dependent_variables;
+    unsigned int equation_index; /// position of the defining equation in the input
     enode *expression;
 };
 
-struct dependency_list {
-    dnode *variable;
-    dlist *next;
-};
-
+/// Edges are frozen after phase 1 into compressed sparse rows: dependencies of v are
+/// dependency_targets[dependency_offsets[v]] .. dependency_targets[dependency_offsets[v + 1] - 1].
 struct dependency_dag {
     dnode *variables;
     unsigned int variables_count;
+    unsigned int *dependency_offsets;
+    unsigned int *dependency_targets;
+    unsigned int *dependent_offsets; /// reverse edges, same layout
+    unsigned int *dependent_targets;
+    unsigned long *reachability; /// bitset row per variable, NULL when there are too many variables
+    unsigned long *defined; /// bitset of variables having an equation
+    unsigned int bitset_words;
+    earena **arenas; /// expressions of all variables live here
+    unsigned int arenas_count;
+};
+
+/// Chunked bump allocator for expression nodes, one chain per parsing thread.
+struct expression_arena {
+    enode nodes[ARENA_CHUNK];
+    unsigned int used;
+    earena *previous;
+};
+
+struct parse_context {
+    earena *arena;
+    unsigned int *dependency_marks;
+    unsigned int *dependencies;
+    unsigned int dependencies_count;
+    unsigned int dependencies_capacity;
+    enode **pending; /// operations still waiting for operands
+    unsigned int pending_count;
+    unsigned int pending_capacity;
+};
+
+struct parsed_equation {
+    int variable_index;
+    enode *expression;
+    unsigned int *dependencies;
+    unsigned int dependencies_count;
+};
+
+struct parse_worker {
+    pthread_t thread;
+    char **lines;
+    pequation *equations;
+    unsigned int first_equation;
+    unsigned int last_equation;
+    unsigned int variables_count;
+    earena *arena;
+};
+
+/// Variables evaluated for every initialization list, x[0] unless -o is given.
+struct output_variables {
+    unsigned int *indices;
+    unsigned int count;
+};
+
+/// Variable trees of a single line. A tree is cancelled, or never started, once every tree
+/// depending on its variable has finished or was cancelled itself and it is not an output.
+struct line_trees {
+    int *states;
+    pid_t *groups; /// process group of each running tree
+    unsigned int *needed; /// unfinished trees and outputs waiting for each variable
+    unsigned int *released; /// variables whose dependencies are being released
+    pid_t *pids; /// open addressing table from a reaped pid to its variable
+    unsigned int *pid_variables;
+    unsigned int pids_mask;
+    unsigned int running;
+};
+
+/// Variable buffers of a single line. A buffer is opened for the first tree using it and the line closes
+/// it once the last such tree has started, each tree keeps only its own buffer and those it reads.
+struct line_pipes {
+    int (*fds)[2];
+    unsigned int *users; /// trees not started yet that use the variable, outputs hold theirs until the end
+    unsigned int *open; /// variables whose buffers are open
+    unsigned int *positions; /// index of each open variable in open
+    unsigned int open_count;
 };
 
-enode *parse_unary_operation(char *expression,
-                             size_t expression_length,
-                             unsigned int dependent_variables[],
-                             unsigned int variables_count);
+/// Stdin read with plain read calls, so its flags shared with stdout stay untouched. Complete lines are
+/// handed out from start.
+struct input_lines {
+    char *buffer;
+    size_t start;
+    size_t length;
+    size_t capacity;
+    int closed;
+};
+
+enode *allocate_node(earena **arena);
+
+void release_arena(earena *arena);
+
+enode *parse_value(const char *expression, const char **end, pcontext *context);
+
+enode *parse_variable(const char *expression, const char **end, pcontext *context);
+
+enode *parse_operation(int operation_code, pcontext *context);
+
+const char *skip_spaces(const char *expression);
 
-enode *parse_value(const char *expression);
+enode *parse_expression(const char *expression, pcontext *context);
 
-enode *parse_variable(const char *expression, unsigned int dependent_variables[]);
+void parse_single_equation(const char *expression, pequation *equation, pcontext *context);
 
-enode *parse_binary_operation(char *expression,
-                              size_t expression_length,
-                              unsigned int dependent_variables[],
-                              unsigned int variables_count);
+void *parse_equations_range(void *data);
 
-enode *parse_expression(char *expression,
-                        size_t expression_length,
-                        unsigned int dependent_variables[],
-                        unsigned int variables_count);
+void parse_equations(ddag *dependency_graph, char **lines, pequation *equations,
+                     unsigned int equations_count, unsigned int threads_count);
 
-int parse_single_equation(char *expression, size_t expression_length, ddag *variables, unsigned int variables_count);
+unsigned int merge_equations(ddag *dependency_graph, pequation *equations, unsigned int equations_count);
 
+void build_adjacency(ddag *dependency_graph, pequation *equations, unsigned int equations_count);
+
+void compute_reachability(ddag *dependency_graph);
 
 void set_variables(unsigned int variables_count, dnode *variables);
 
 ddag *initialize_dependency_graph(unsigned int count);
 
-int read_parse_equation(unsigned int variables_count, ddag *dependency_graph);
+void read_equations(ilines *input, unsigned int equations_count, unsigned int *equations_numbers, char **lines);
+
+unsigned int topological_sort(ddag *dependency_graph, unsigned int equations_limit, unsigned int *order);
+
+int is_cycled(ddag *dependency_graph, unsigned int equations_limit);
+
+unsigned int find_cycle_closing_equation(ddag *dependency_graph, unsigned int equations_count);
+
+int is_circuit_solvable(ddag *dependency_graph, const ovariables *outputs, int variables_initialized[],
+                        int active_variables[], int outputs_solvable[]);
+
+int variable_status(unsigned int v, ddag *dependency_graph, int *variables_initialized, int *active_variables);
+
+int dfs_is_solvable(unsigned int v, ddag *dependency_graph, int *variables_initialized, int *active_variables);
+
+void retain_needed_variables(ddag *dependency_graph, const ovariables *outputs, const int *outputs_solvable,
+                             int *active_variables);
 
-int is_cycled(ddag *dependency_graph);
+int bitsets_is_solvable(ddag *dependency_graph, const ovariables *outputs, int *variables_initialized,
+                        int *active_variables, int *outputs_solvable);
 
-int dfs_cycle_search(int v, dnode *vertices, unsigned int vertices_visited[]);
+void open_input_lines(ilines *input);
 
-int is_circuit_solvable(ddag *dependency_graph, int variables_initialized[], int active_variables[]);
+void fill_input_lines(ilines *input);
 
-int dfs_is_solvable(dnode *v, dnode *variables, int *variables_initialized, int *active_variables);
+char *next_input_line(ilines *input);
 
-int read_resolve_initialization(ddag *dependency_graph,
-                                int *variables_initialized,
-                                int *active_circuits,
-                                long *variables_values,
-                                int *equation_number);
+char *wait_input_line(ilines *input);
+
+void close_input_lines(ilines *input);
+
+int resolve_initialization(ddag *dependency_graph,
+                           const ovariables *outputs,
+                           const char *expression,
+                           int *variables_initialized,
+                           int *active_circuits,
+                           long *variables_values,
+                           int *outputs_solvable,
+                           int *equation_number);
+
+void parse_output_variables(char *list, ovariables *outputs);
 
 void spawn_tree(int var_index, dnode *variables, int var_pipes[][2]);
 
+void open_line_trees(ltrees *trees, const ddag *dependency_graph, const ovariables *outputs,
+                     const int *active_circuits);
+
+void add_line_tree(ltrees *trees, unsigned int var_index, pid_t pid);
+
+void release_dependencies(ltrees *trees, const ddag *dependency_graph, const int *active_circuits,
+                          unsigned int var_index);
+
+void reap_line_trees(ltrees *trees, const ddag *dependency_graph, const int *active_circuits, int options);
+
+void close_line_trees(ltrees *trees);
+
+void open_line_pipes(lpipes *pipes, const ddag *dependency_graph, const ovariables *outputs,
+                     const int *active_circuits, const long *variables_values);
+
+int line_pipe_open(const lpipes *pipes, unsigned int var_index);
+
+void acquire_line_pipe(lpipes *pipes, unsigned int var_index, const int *active_circuits,
+                       const long *variables_values);
+
+void release_line_pipe(lpipes *pipes, unsigned int var_index);
+
+void acquire_tree_pipes(lpipes *pipes, const ddag *dependency_graph, unsigned int var_index,
+                        const int *active_circuits, const long *variables_values);
+
+void release_tree_pipes(lpipes *pipes, const ddag *dependency_graph, unsigned int var_index);
+
+void keep_tree_pipes(lpipes *pipes, const ddag *dependency_graph, unsigned int var_index);
+
+void close_line_pipes(lpipes *pipes);
+
 void put_val_into_pipe(const int var_index, const long *variables_values, int var_pipes[][2]);
 
 void spawn_circuit_node(enode *node, int pipe_up[2], int var_pipes[][2]);
 
+const char *node_trace_format(const enode *node);
+
 void spawn_variable_node(const enode *node, int var_pipes[][2], char *var_value);
 
-int spawn_negate_node(const enode *node, int var_pipes[][2], char *var_string);
+int spawn_negate_node(const enode *node, int var_pipes[][2], char *var_string, enode **next_node,
+                      int next_pipe[2]);
 
-int spawn_binary_node(enode *node, int var_pipes[][2], char *var_string);
+int spawn_binary_node(enode *node, int var_pipes[][2], char *var_string, enode **next_node, int next_pipe[2]);
 
-void process_single_input(unsigned int variables_count, const ddag *dependency_graph, const int *active_circuits,
-                          const long *variables_values, int equation_number);
+void bind_to_parent(pid_t parent);
 
-void release_memory(ddag *dependencies);
+pid_t spawn_operand(enode *node, enode *operand, int pipe_down[2], enode **next_node, int next_pipe[2]);
 
-void release_variable(dnode variable);
+void read_value(int fd, char *value);
 
-void release_expression(enode *expression);
+long read_operand(int operand_fd);
 
-void release_dependency_list(dlist *list_element);
+long multiply_operands(int pipe_down_left[2], int pipe_down_right[2], pid_t pids[2]);
+
+void process_single_input(unsigned int variables_count, const ddag *dependency_graph, const ovariables *outputs,
+                          const int *active_circuits, const long *variables_values, const int *outputs_solvable,
+                          const rrecord *line, rchannel *results);
+
+void release_memory(ddag *dependencies);
 
 #endif //PWZADANIE3_CIRCUIT_H
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#include "results.h"
+#include "err.h"
+
+rchannel *open_result_channel() {
+    rchannel *channel = malloc(sizeof(rchannel));
+
+    if (pipe(channel->pipe_fds) == -1) {
+        syserr("Error in pipe\n");
+    }
+
+    channel->epoll_fd = epoll_create1(0);
+    if (channel->epoll_fd == -1) {
+        syserr("Error in epoll_create\n");
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = channel->pipe_fds[0];
+
+    if (epoll_ctl(channel->epoll_fd, EPOLL_CTL_ADD, channel->pipe_fds[0], &event) == -1) {
+        syserr("Error in epoll_ctl\n");
+    }
+
+    return channel;
+}
+
+void detach_result_reader(rchannel *channel) {
+    /// Workers only write to the channel, reading end belongs to the main process.
+    if (close(channel->epoll_fd) == -1) {
+        syserr("Error while closing epoll\n");
+    }
+
+    if (close(channel->pipe_fds[0]) == -1) {
+        syserr("Error while closing pipe\n");
+    }
+}
+
+void send_result(rchannel *channel, const rrecord *record) {
+    if (write(channel->pipe_fds[1], record, sizeof(rrecord)) != sizeof(rrecord)) {
+        syserr("Error while writing\n");
+    }
+}
+
+int read_result(rchannel *channel, rbuffer **buffers, rrecord *record) {
+    if (read(channel->pipe_fds[0], record, sizeof(rrecord)) != sizeof(rrecord)) {
+        syserr("Error while reading\n");
+    }
+
+    store_result(buffers[record->client], record);
+
+    /// Worker sends its outputs in order, the last one completes the line.
+    return record->output + 1 == buffers[record->client]->outputs_count;
+}
+
+unsigned int receive_results(rchannel *channel, rbuffer **buffers, int timeout) {
+    unsigned int received = 0;
+    struct epoll_event event;
+
+    /// After the first line completes remaining records are only drained, never waited for.
+    while (epoll_wait(channel->epoll_fd, &event, 1, received == 0 ? timeout : 0) == 1) {
+        rrecord record;
+        received += read_result(channel, buffers, &record);
+    }
+
+    return received;
+}
+
+void close_result_channel(rchannel *channel) {
+    if (close(channel->epoll_fd) == -1) {
+        syserr("Error while closing epoll\n");
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (close(channel->pipe_fds[i]) == -1) {
+            syserr("Error while closing pipe\n");
+        }
+    }
+
+    free(channel);
+}
+
+rbuffer *create_reorder_buffer(unsigned int capacity, unsigned int outputs_count, int completion_order,
+                               int output_fd) {
+    rbuffer *buffer = malloc(sizeof(rbuffer));
+
+    buffer->slots = malloc((size_t) capacity * outputs_count * sizeof(rrecord));
+    buffer->slot_filled = calloc(capacity, sizeof(unsigned int));
+    buffer->capacity = capacity;
+    buffer->base = 0;
+    buffer->outputs_count = outputs_count;
+    buffer->next_to_emit = 0;
+    buffer->completion_order = completion_order;
+    buffer->output_fd = output_fd;
+    buffer->output = NULL;
+    buffer->output_length = 0;
+    buffer->output_capacity = 0;
+    buffer->output_closed = 0;
+
+    return buffer;
+}
+
+void reserve_slots(rbuffer *buffer, unsigned int sequence) {
+    unsigned int emitted = buffer->next_to_emit - buffer->base;
+    unsigned int needed = sequence - buffer->next_to_emit + 1;
+
+    /// Dropping slots of emitted lines first, growing only if that is not enough.
+    memmove(buffer->slots, buffer->slots + (size_t) emitted * buffer->outputs_count,
+            (size_t) (buffer->capacity - emitted) * buffer->outputs_count * sizeof(rrecord));
+    memmove(buffer->slot_filled, buffer->slot_filled + emitted, (buffer->capacity - emitted) * sizeof(unsigned int));
+    memset(buffer->slot_filled + buffer->capacity - emitted, 0, emitted * sizeof(unsigned int));
+    buffer->base = buffer->next_to_emit;
+
+    if (needed > buffer->capacity) {
+        unsigned int capacity = buffer->capacity * 2 > needed ? buffer->capacity * 2 : needed;
+
+        buffer->slots = realloc(buffer->slots, (size_t) capacity * buffer->outputs_count * sizeof(rrecord));
+        buffer->slot_filled = realloc(buffer->slot_filled, capacity * sizeof(unsigned int));
+        memset(buffer->slot_filled + buffer->capacity, 0, (capacity - buffer->capacity) * sizeof(unsigned int));
+        buffer->capacity = capacity;
+    }
+}
+
+void store_result(rbuffer *buffer, const rrecord *record) {
+    if (record->sequence - buffer->base >= buffer->capacity) {
+        reserve_slots(buffer, record->sequence);
+    }
+
+    unsigned int line = record->sequence - buffer->base;
+    rrecord *line_slots = &buffer->slots[(size_t) line * buffer->outputs_count];
+
+    line_slots[record->output] = *record;
+    ++buffer->slot_filled[line];
+
+    if (buffer->completion_order && buffer->slot_filled[line] == buffer->outputs_count) {
+        emit_result(buffer, line_slots);
+    }
+
+    while (buffer->next_to_emit - buffer->base < buffer->capacity
+           && buffer->slot_filled[buffer->next_to_emit - buffer->base] == buffer->outputs_count) {
+        if (buffer->completion_order == 0) {
+            emit_result(buffer, &buffer->slots[(size_t) (buffer->next_to_emit - buffer->base) * buffer->outputs_count]);
+        }
+        ++buffer->next_to_emit;
+    }
+
+    flush_output(buffer);
+}
+
+void store_failed_line(rbuffer *buffer, int client, unsigned int sequence, int equation_number) {
+    unsigned int received = 0;
+
+    if (sequence < buffer->next_to_emit) {
+        return;
+    }
+
+    /// Outputs arrive in order, a worker which died halfway only misses the last ones.
+    if (sequence - buffer->base < buffer->capacity) {
+        received = buffer->slot_filled[sequence - buffer->base];
+    }
+
+    for (unsigned int o = received; o < buffer->outputs_count; ++o) {
+        rrecord failed;
+        failed.worker = 0;
+        failed.client = client;
+        failed.sequence = sequence;
+        failed.output = o;
+        failed.equation_number = equation_number;
+        failed.status = RESULT_FAILED;
+        failed.value = 0;
+
+        store_result(buffer, &failed);
+    }
+}
+
+void emit_result(rbuffer *buffer, const rrecord *records) {
+    unsigned int outputs_count = buffer->outputs_count;
+    int any_passed = 0;
+
+    if (buffer->output_closed) {
+        return;
+    }
+
+    if (buffer->output_capacity - buffer->output_length < RESULT_FIELD_SIZE * (outputs_count + 1)) {
+        buffer->output_capacity = buffer->output_capacity * 2 + RESULT_FIELD_SIZE * (outputs_count + 1);
+        buffer->output = realloc(buffer->output, buffer->output_capacity);
+    }
+
+    char *line = buffer->output + buffer->output_length;
+    int length;
+
+    for (unsigned int i = 0; i < outputs_count; ++i) {
+        if (records[i].status == RESULT_PASSED) {
+            any_passed = 1;
+        }
+    }
+
+    if (any_passed == 0) {
+        length = sprintf(line, "%d F\n", records[0].equation_number);
+    } else {
+        /// Outputs which can not be evaluated are marked with F in their column.
+        length = sprintf(line, "%d P", records[0].equation_number);
+        for (unsigned int i = 0; i < outputs_count; ++i) {
+            if (records[i].status == RESULT_PASSED) {
+                length += sprintf(line + length, " %ld", records[i].value);
+            } else {
+                length += sprintf(line + length, " F");
+            }
+        }
+        length += sprintf(line + length, "\n");
+    }
+
+    buffer->output_length += length;
+}
+
+int flush_output(rbuffer *buffer) {
+    size_t written = 0;
+
+    while (written < buffer->output_length) {
+        ssize_t count = write(buffer->output_fd, buffer->output + written, buffer->output_length - written);
+
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            /// Readers which already hung up are not an error, their lines are simply dropped.
+            if (errno != EPIPE && errno != ECONNRESET) {
+                syserr("Error while writing\n");
+            }
+            buffer->output_closed = 1;
+            buffer->output_length = 0;
+            return -1;
+        }
+
+        written += count;
+    }
+
+    /// Partially written line stays at the front and goes out on the next call.
+    buffer->output_length -= written;
+    memmove(buffer->output, buffer->output + written, buffer->output_length);
+
+    return 0;
+}
+
+void drain_output(rbuffer *buffer) {
+    struct pollfd output;
+
+    output.fd = buffer->output_fd;
+    output.events = POLLOUT;
+
+    /// Output descriptor may be non-blocking, whatever is still queued waits until it can be written.
+    while (buffer->output_length > 0 && buffer->output_closed == 0) {
+        if (poll(&output, 1, -1) == -1 && errno != EINTR) {
+            syserr("Error in poll\n");
+        }
+
+        flush_output(buffer);
+    }
+}
+
+void release_reorder_buffer(rbuffer *buffer) {
+    free(buffer->slots);
+    free(buffer->slot_filled);
+    free(buffer->output);
+    free(buffer);
+}
+
+wtable *create_worker_table() {
+    wtable *workers = malloc(sizeof(wtable));
+
+    workers->mask = WORKER_TABLE_INITIAL - 1;
+    workers->count = 0;
+    workers->pids = calloc(WORKER_TABLE_INITIAL, sizeof(pid_t));
+    workers->clients = malloc(WORKER_TABLE_INITIAL * sizeof(int));
+    workers->sequences = malloc(WORKER_TABLE_INITIAL * sizeof(unsigned int));
+    workers->equation_numbers = malloc(WORKER_TABLE_INITIAL * sizeof(int));
+
+    return workers;
+}
+
+void add_worker(wtable *workers, pid_t pid, const rrecord *line) {
+    /// Kept at most half full, so probing stays short.
+    if ((workers->count + 1) * 2 > workers->mask + 1) {
+        wtable previous = *workers;
+        unsigned int capacity = (previous.mask + 1) * 2;
+
+        workers->mask = capacity - 1;
+        workers->count = 0;
+        workers->pids = calloc(capacity, sizeof(pid_t));
+        workers->clients = malloc(capacity * sizeof(int));
+        workers->sequences = malloc(capacity * sizeof(unsigned int));
+        workers->equation_numbers = malloc(capacity * sizeof(int));
+
+        for (unsigned int i = 0; i <= previous.mask; ++i) {
+            if (previous.pids[i] != 0) {
+                rrecord moved;
+                moved.client = previous.clients[i];
+                moved.sequence = previous.sequences[i];
+                moved.equation_number = previous.equation_numbers[i];
+                add_worker(workers, previous.pids[i], &moved);
+            }
+        }
+
+        free(previous.pids);
+        free(previous.clients);
+        free(previous.sequences);
+        free(previous.equation_numbers);
+    }
+
+    unsigned int slot = (unsigned int) pid & workers->mask;
+
+    while (workers->pids[slot] != 0) {
+        slot = (slot + 1) & workers->mask;
+    }
+
+    workers->pids[slot] = pid;
+    workers->clients[slot] = line->client;
+    workers->sequences[slot] = line->sequence;
+    workers->equation_numbers[slot] = line->equation_number;
+    ++workers->count;
+}
+
+int remove_worker(wtable *workers, pid_t pid, rrecord *line) {
+    unsigned int slot = (unsigned int) pid & workers->mask;
+
+    while (workers->pids[slot] != pid) {
+        if (workers->pids[slot] == 0) {
+            return 0;
+        }
+        slot = (slot + 1) & workers->mask;
+    }
+
+    line->client = workers->clients[slot];
+    line->sequence = workers->sequences[slot];
+    line->equation_number = workers->equation_numbers[slot];
+    --workers->count;
+
+    /// Entries probed past the freed slot are moved back, so lookups never stop at a hole.
+    unsigned int next = slot;
+    while (1) {
+        next = (next + 1) & workers->mask;
+
+        if (workers->pids[next] == 0) {
+            break;
+        }
+
+        unsigned int home = (unsigned int) workers->pids[next] & workers->mask;
+
+        if (((next - home) & workers->mask) >= ((next - slot) & workers->mask)) {
+            workers->pids[slot] = workers->pids[next];
+            workers->clients[slot] = workers->clients[next];
+            workers->sequences[slot] = workers->sequences[next];
+            workers->equation_numbers[slot] = workers->equation_numbers[next];
+            slot = next;
+        }
+    }
+
+    workers->pids[slot] = 0;
+
+    return 1;
+}
+
+unsigned int reap_workers(wtable *workers, rchannel *channel, rbuffer **buffers) {
+    unsigned int reaped_count = 0;
+    unsigned int reaped_capacity = 16;
+    pid_t *reaped = malloc(reaped_capacity * sizeof(pid_t));
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (reaped_count == reaped_capacity) {
+            reaped_capacity *= 2;
+            reaped = realloc(reaped, reaped_capacity * sizeof(pid_t));
+        }
+        reaped[reaped_count++] = pid;
+    }
+
+    if (pid == -1 && errno != ECHILD) {
+        syserr("Error in wait\n");
+    }
+
+    unsigned int finished = 0;
+    struct epoll_event event;
+
+    /// Whatever a dead worker managed to send is already in the channel, it is read before filling the gaps.
+    /// Answered workers leave the table here too, their buffers may be released before they are reaped.
+    while (epoll_wait(channel->epoll_fd, &event, 1, 0) == 1) {
+        rrecord record;
+
+        if (read_result(channel, buffers, &record) == 1 && remove_worker(workers, record.worker, &record)) {
+            ++finished;
+        }
+    }
+
+    for (unsigned int i = 0; i < reaped_count; ++i) {
+        rrecord line;
+
+        if (remove_worker(workers, reaped[i], &line)) {
+            store_failed_line(buffers[line.client], line.client, line.sequence, line.equation_number);
+            ++finished;
+        }
+    }
+
+    free(reaped);
+
+    return finished;
+}
+
+void release_worker_table(wtable *workers) {
+    free(workers->pids);
+    free(workers->clients);
+    free(workers->sequences);
+    free(workers->equation_numbers);
+    free(workers);
+}
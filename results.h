@@ -0,0 +1,104 @@
+#ifndef PWZADANIE3_RESULTS_H
+#define PWZADANIE3_RESULTS_H
+
+#include <sys/types.h>
+
+#define RESULT_FAILED   0
+#define RESULT_PASSED   1
+
+#define RESULT_FIELD_SIZE   24 /// enough for " " followed by any long
+
+#define WORKER_TABLE_INITIAL    64
+#define REORDER_INITIAL_LINES   16 /// grown by reserve_slots once lines run ahead of the first unanswered one
+
+typedef struct result_record rrecord;
+typedef struct result_channel rchannel;
+typedef struct reorder_buffer rbuffer;
+typedef struct worker_table wtable;
+
+/// Fixed-size record sent by a worker, small enough for a single atomic pipe write.
+struct result_record {
+    pid_t worker; /// 0 when no process was spawned for the line
+    int client; /// reorder buffer the line belongs to, 0 outside of server mode
+    unsigned int sequence; /// position of the line among initialization lists
+    unsigned int output; /// position of the variable among requested outputs
+    int equation_number;
+    int status;
+    long value;
+};
+
+/// Single pipe shared by all workers, multiplexed by the main process with epoll.
+struct result_channel {
+    int pipe_fds[2];
+    int epoll_fd;
+};
+
+/// Holds results which arrived ahead of their turn until they can be emitted in input order.
+/// Every line owns outputs_count consecutive slots, one per requested output variable.
+/// Slots start at line base and the window moves forward as lines are emitted.
+/// Emitted lines wait in output until the descriptor accepts them, so a slow reader never blocks the others.
+struct reorder_buffer {
+    rrecord *slots;
+    unsigned int *slot_filled; /// outputs received so far for each line
+    unsigned int capacity;
+    unsigned int base;
+    unsigned int outputs_count;
+    unsigned int next_to_emit; /// every line before it has already been emitted
+    int completion_order;
+    int output_fd;
+    char *output; /// formatted lines not written yet
+    size_t output_length;
+    size_t output_capacity;
+    int output_closed; /// reader hung up, further lines are discarded
+};
+
+/// Line workers in flight, so a worker which died without sending its results can be answered for.
+struct worker_table {
+    pid_t *pids; /// open addressing by pid, 0 marks a free slot
+    int *clients;
+    unsigned int *sequences;
+    int *equation_numbers;
+    unsigned int mask;
+    unsigned int count;
+};
+
+rchannel *open_result_channel();
+
+void detach_result_reader(rchannel *channel);
+
+void send_result(rchannel *channel, const rrecord *record);
+
+int read_result(rchannel *channel, rbuffer **buffers, rrecord *record);
+
+unsigned int receive_results(rchannel *channel, rbuffer **buffers, int timeout);
+
+void close_result_channel(rchannel *channel);
+
+rbuffer *create_reorder_buffer(unsigned int capacity, unsigned int outputs_count, int completion_order,
+                               int output_fd);
+
+void reserve_slots(rbuffer *buffer, unsigned int sequence);
+
+void store_result(rbuffer *buffer, const rrecord *record);
+
+void store_failed_line(rbuffer *buffer, int client, unsigned int sequence, int equation_number);
+
+void emit_result(rbuffer *buffer, const rrecord *records);
+
+int flush_output(rbuffer *buffer);
+
+void drain_output(rbuffer *buffer);
+
+void release_reorder_buffer(rbuffer *buffer);
+
+wtable *create_worker_table();
+
+void add_worker(wtable *workers, pid_t pid, const rrecord *line);
+
+int remove_worker(wtable *workers, pid_t pid, rrecord *line);
+
+unsigned int reap_workers(wtable *workers, rchannel *channel, rbuffer **buffers);
+
+void release_worker_table(wtable *workers);
+
+#endif //PWZADANIE3_RESULTS_H
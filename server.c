@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+void serve_circuit(const char *socket_path, ddag *dependency_graph, const ovariables *outputs, int completion_order) {
+    cserver server;
+    sigset_t stop_signals;
+    struct epoll_event events[SERVER_EVENTS];
+    int stopping = 0;
+
+    server.dependency_graph = dependency_graph;
+    server.outputs = outputs;
+    server.socket_path = socket_path;
+    server.completion_order = completion_order;
+    server.clients = NULL;
+    server.buffers = NULL;
+    server.clients_capacity = 0;
+    server.clients_count = 0;
+    server.accept_paused = 0;
+    server.pending_lines = 0;
+    server.variables_initialized = malloc(dependency_graph->variables_count * sizeof(int));
+    server.active_circuits = malloc(dependency_graph->variables_count * sizeof(int));
+    server.variables_values = malloc(dependency_graph->variables_count * sizeof(long));
+    server.outputs_solvable = malloc(outputs->count * sizeof(int));
+
+    /// Clients hanging up must not take the server down.
+    signal(SIGPIPE, SIG_IGN);
+
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    /// Workers are reaped when they exit, those which died before answering get their lines failed.
+    sigaddset(&stop_signals, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &stop_signals, &server.original_mask) == -1) {
+        syserr("Error in sigprocmask\n");
+    }
+
+    server.signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK);
+    if (server.signal_fd == -1) {
+        syserr("Error in signalfd\n");
+    }
+
+    server.epoll_fd = epoll_create1(0);
+    if (server.epoll_fd == -1) {
+        syserr("Error in epoll_create\n");
+    }
+
+    server.results = open_result_channel();
+    server.workers = create_worker_table();
+
+    open_listening_socket(&server);
+    watch_descriptor(&server, server.signal_fd);
+    watch_descriptor(&server, server.results->pipe_fds[0]);
+
+    /// After SIGINT or SIGTERM no new lines are accepted, but those already started are answered.
+    while (stopping == 0 || server.pending_lines > 0) {
+        int events_count = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, -1);
+
+        if (events_count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syserr("Error in epoll_wait\n");
+        }
+
+        for (int i = 0; i < events_count; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == server.listen_fd) {
+                accept_clients(&server);
+            } else if (fd == server.signal_fd) {
+                struct signalfd_siginfo signal_info;
+                int stop_requested = 0;
+                ssize_t read_count;
+
+                while ((read_count = read(server.signal_fd, &signal_info, sizeof(signal_info))) > 0) {
+                    if (signal_info.ssi_signo != SIGCHLD) {
+                        stop_requested = 1;
+                    }
+                }
+
+                if (read_count == -1 && errno != EAGAIN) {
+                    syserr("Error while reading\n");
+                }
+
+                server.pending_lines -= reap_workers(server.workers, server.results, server.buffers);
+
+                for (int c = 0; c < server.clients_capacity; ++c) {
+                    if (server.clients[c] != NULL) {
+                        refresh_client(&server, server.clients[c]);
+                    }
+                }
+
+                if (stop_requested && stopping == 0) {
+                    stopping = 1;
+                    stop_listening(&server);
+
+                    for (int c = 0; c < server.clients_capacity; ++c) {
+                        if (server.clients[c] != NULL && server.clients[c]->input_closed == 0) {
+                            close_client_input(&server, server.clients[c]);
+                            refresh_client(&server, server.clients[c]);
+                        }
+                    }
+                }
+            } else if (fd == server.results->pipe_fds[0]) {
+                rrecord record;
+                struct epoll_event result_event;
+
+                /// Reaping earlier in this batch of events may have drained the channel already.
+                if (epoll_wait(server.results->epoll_fd, &result_event, 1, 0) != 1) {
+                    continue;
+                }
+
+                /// An answered worker leaves the table, so its exit cannot touch a client released meanwhile.
+                if (read_result(server.results, server.buffers, &record) == 1
+                    && remove_worker(server.workers, record.worker, &record)) {
+                    --server.pending_lines;
+                }
+                refresh_client(&server, server.clients[record.client]);
+            } else if (fd < server.clients_capacity && server.clients[fd] != NULL) {
+                handle_client(&server, server.clients[fd], events[i].events);
+            }
+        }
+    }
+
+    /// Replies nobody is reading any more are abandoned on shutdown.
+    for (int c = 0; c < server.clients_capacity; ++c) {
+        if (server.clients[c] != NULL) {
+            drop_client(&server, server.clients[c]);
+        }
+    }
+
+    if (sigprocmask(SIG_SETMASK, &server.original_mask, NULL) == -1) {
+        syserr("Error in sigprocmask\n");
+    }
+
+    if (close(server.signal_fd) == -1 || close(server.epoll_fd) == -1) {
+        syserr("Error while closing descriptor\n");
+    }
+
+    close_result_channel(server.results);
+    release_worker_table(server.workers);
+
+    free(server.clients);
+    free(server.buffers);
+    free(server.variables_initialized);
+    free(server.active_circuits);
+    free(server.variables_values);
+    free(server.outputs_solvable);
+}
+
+void open_listening_socket(cserver *server) {
+    struct sockaddr_un address;
+
+    if (strlen(server->socket_path) >= sizeof(address.sun_path)) {
+        fatal("Socket path %s is too long", server->socket_path);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, server->socket_path);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server->listen_fd == -1) {
+        syserr("Error in socket\n");
+    }
+
+    /// Socket left behind by a previous run would make bind fail.
+    if (unlink(server->socket_path) == -1 && errno != ENOENT) {
+        syserr("Error in unlink\n");
+    }
+
+    if (bind(server->listen_fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        syserr("Error in bind\n");
+    }
+
+    if (listen(server->listen_fd, SERVER_BACKLOG) == -1) {
+        syserr("Error in listen\n");
+    }
+
+    watch_descriptor(server, server->listen_fd);
+}
+
+void stop_listening(cserver *server) {
+    if (close(server->listen_fd) == -1) {
+        syserr("Error while closing socket\n");
+    }
+
+    server->listen_fd = -1;
+    server->accept_paused = 0;
+
+    if (unlink(server->socket_path) == -1 && errno != ENOENT) {
+        syserr("Error in unlink\n");
+    }
+}
+
+void watch_descriptor(cserver *server, int fd) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        syserr("Error in epoll_ctl\n");
+    }
+}
+
+void accept_clients(cserver *server) {
+    int fd;
+
+    while (1) {
+        fd = accept(server->listen_fd, NULL, NULL);
+
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            /// Connection which failed on its way in is not a reason to stop serving the others.
+            fprintf(stderr, "ERROR: Error in accept (%d; %s)\n", errno, strerror(errno));
+            if (errno == ECONNABORTED || errno == EINTR || errno == EPROTO) {
+                continue;
+            }
+            /// Out of descriptors, the pending connection waits until some client goes away.
+            if (server->clients_count > 0) {
+                if (epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->listen_fd, NULL) == -1) {
+                    syserr("Error in epoll_ctl\n");
+                }
+                server->accept_paused = 1;
+            }
+            return;
+        }
+
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+            syserr("Error in fcntl\n");
+        }
+
+        if (fd >= server->clients_capacity) {
+            int capacity = server->clients_capacity * 2 > fd + 1 ? server->clients_capacity * 2 : fd + 1;
+
+            server->clients = realloc(server->clients, capacity * sizeof(sclient *));
+            server->buffers = realloc(server->buffers, capacity * sizeof(rbuffer *));
+
+            for (int c = server->clients_capacity; c < capacity; ++c) {
+                server->clients[c] = NULL;
+                server->buffers[c] = NULL;
+            }
+            server->clients_capacity = capacity;
+        }
+
+        sclient *client = malloc(sizeof(sclient));
+        client->fd = fd;
+        client->input = NULL;
+        client->input_length = 0;
+        client->input_capacity = 0;
+        client->next_sequence = 0;
+        client->input_closed = 0;
+        client->watched_events = 0;
+
+        server->clients[fd] = client;
+        server->buffers[fd] = create_reorder_buffer(REORDER_INITIAL_LINES, server->outputs->count,
+                                                    server->completion_order, fd);
+        ++server->clients_count;
+
+        watch_client(server, client);
+    }
+}
+
+void handle_client(cserver *server, sclient *client, uint32_t events) {
+    int fd = client->fd;
+
+    if (client->watched_events & EPOLLIN && events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        read_client(server, client);
+    }
+
+    /// Reading may have answered and released the client already.
+    if (server->clients[fd] == client && events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        write_client(server, client);
+    }
+}
+
+void read_client(cserver *server, sclient *client) {
+    if (client->input_capacity - client->input_length < CLIENT_READ_SIZE + 1) {
+        client->input_capacity = client->input_length + CLIENT_READ_SIZE + 1;
+        client->input = realloc(client->input, client->input_capacity);
+    }
+
+    ssize_t read_count = read(client->fd, client->input + client->input_length, CLIENT_READ_SIZE);
+
+    if (read_count == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        if (errno != ECONNRESET) {
+            syserr("Error while reading\n");
+        }
+        read_count = 0;
+    }
+
+    client->input_length += read_count;
+
+    /// Last line does not need a newline once the client stops sending.
+    if (read_count == 0) {
+        client->input[client->input_length++] = '\n';
+    }
+
+    char *line = client->input;
+    char *line_end;
+
+    while ((line_end = memchr(line, '\n', client->input_length - (line - client->input))) != NULL) {
+        *line_end = 0;
+        dispatch_line(server, client, line);
+        line = line_end + 1;
+    }
+
+    client->input_length -= line - client->input;
+    memmove(client->input, line, client->input_length);
+
+    if (read_count == 0) {
+        close_client_input(server, client);
+    }
+
+    refresh_client(server, client);
+}
+
+void write_client(cserver *server, sclient *client) {
+    flush_output(server->buffers[client->fd]);
+    refresh_client(server, client);
+}
+
+void watch_client(cserver *server, sclient *client) {
+    rbuffer *buffer = server->buffers[client->fd];
+    uint32_t events = 0;
+    struct epoll_event event;
+
+    /// Client not reading its replies is not read from either, until they drain.
+    if (client->input_closed == 0 && buffer->output_length < CLIENT_OUTPUT_LIMIT) {
+        events |= EPOLLIN;
+    }
+    if (buffer->output_length > 0) {
+        events |= EPOLLOUT;
+    }
+
+    if (events == client->watched_events) {
+        return;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = client->fd;
+
+    /// Descriptor with nothing to wait for is removed, so a hang-up is not reported over and over.
+    int operation = events == 0 ? EPOLL_CTL_DEL : client->watched_events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    if (epoll_ctl(server->epoll_fd, operation, client->fd, &event) == -1) {
+        syserr("Error in epoll_ctl\n");
+    }
+
+    client->watched_events = events;
+}
+
+void refresh_client(cserver *server, sclient *client) {
+    /// Client which stopped receiving replies gets no more lines processed.
+    if (server->buffers[client->fd]->output_closed && client->input_closed == 0) {
+        close_client_input(server, client);
+    }
+
+    watch_client(server, client);
+    release_client_if_done(server, client);
+}
+
+void dispatch_line(cserver *server, sclient *client, char *line) {
+    unsigned int variables_count = server->dependency_graph->variables_count;
+    int equation_number;
+
+    memset(server->variables_initialized, 0, variables_count * sizeof(int));
+    memset(server->active_circuits, 0, variables_count * sizeof(int));
+    memset(server->variables_values, 0, variables_count * sizeof(long));
+
+    int solvable_count = resolve_initialization(server->dependency_graph, server->outputs, line,
+                                                server->variables_initialized, server->active_circuits,
+                                                server->variables_values, server->outputs_solvable,
+                                                &equation_number);
+
+    if (solvable_count == -1) {
+        return; /// Empty or malformed line, there is no number to answer with.
+    }
+
+    rrecord header;
+    header.client = client->fd;
+    header.sequence = client->next_sequence++;
+    header.equation_number = equation_number;
+
+    if (solvable_count == 0) {
+        store_failed_line(server->buffers[client->fd], client->fd, header.sequence, equation_number);
+        return;
+    }
+
+    pid_t worker = fork();
+
+    switch (worker) {
+        case -1:
+            syserr("Error in fork\n");
+        case 0:
+            close_worker_descriptors(server);
+            detach_result_reader(server->results);
+            process_single_input(variables_count, server->dependency_graph, server->outputs,
+                                 server->active_circuits, server->variables_values, server->outputs_solvable,
+                                 &header, server->results);
+            exit(1);
+        default:
+            add_worker(server->workers, worker, &header);
+            ++server->pending_lines;
+    }
+}
+
+void close_client_input(cserver *server, sclient *client) {
+    client->input_closed = 1;
+}
+
+void release_client_if_done(cserver *server, sclient *client) {
+    rbuffer *buffer = server->buffers[client->fd];
+
+    /// Connection stays open until every line the client sent is answered and written.
+    if (client->input_closed == 0 || buffer->next_to_emit != client->next_sequence || buffer->output_length > 0) {
+        return;
+    }
+
+    drop_client(server, client);
+}
+
+void drop_client(cserver *server, sclient *client) {
+    if (client->watched_events != 0 && epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
+        syserr("Error in epoll_ctl\n");
+    }
+
+    if (close(client->fd) == -1) {
+        syserr("Error while closing socket\n");
+    }
+
+    release_reorder_buffer(server->buffers[client->fd]);
+    server->buffers[client->fd] = NULL;
+    server->clients[client->fd] = NULL;
+
+    free(client->input);
+    free(client);
+
+    --server->clients_count;
+
+    if (server->accept_paused) {
+        server->accept_paused = 0;
+        watch_descriptor(server, server->listen_fd);
+    }
+}
+
+void close_worker_descriptors(cserver *server) {
+    if (server->listen_fd != -1 && close(server->listen_fd) == -1) {
+        syserr("Error while closing socket\n");
+    }
+
+    if (close(server->signal_fd) == -1 || close(server->epoll_fd) == -1) {
+        syserr("Error while closing descriptor\n");
+    }
+
+    for (int c = 0; c < server->clients_capacity; ++c) {
+        if (server->clients[c] != NULL && close(c) == -1) {
+            syserr("Error while closing socket\n");
+        }
+    }
+
+    /// Workers cancel subtrees with SIGTERM, so it has to reach them again.
+    signal(SIGPIPE, SIG_DFL);
+    if (sigprocmask(SIG_SETMASK, &server->original_mask, NULL) == -1) {
+        syserr("Error in sigprocmask\n");
+    }
+}
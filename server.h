@@ -0,0 +1,83 @@
+#ifndef PWZADANIE3_SERVER_H
+#define PWZADANIE3_SERVER_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "circuit.h"
+#include "results.h"
+
+#define SERVER_BACKLOG          64
+#define SERVER_EVENTS           64
+#define CLIENT_READ_SIZE        4096
+#define CLIENT_OUTPUT_LIMIT     (1 << 20) /// queued reply bytes above which client input is no longer read
+
+typedef struct server_client sclient;
+typedef struct circuit_server cserver;
+
+struct server_client {
+    int fd;
+    char *input; /// bytes received after the last complete line
+    size_t input_length;
+    size_t input_capacity;
+    unsigned int next_sequence;
+    int input_closed;
+    uint32_t watched_events; /// events the descriptor is registered for in epoll, 0 when it is not
+};
+
+/// Daemon answering initialization lists for one circuit loaded at startup.
+/// Clients and their reorder buffers are indexed by the client's descriptor.
+struct circuit_server {
+    ddag *dependency_graph;
+    const ovariables *outputs;
+    const char *socket_path;
+    int completion_order;
+    int listen_fd;
+    int signal_fd;
+    int epoll_fd;
+    rchannel *results;
+    wtable *workers;
+    sclient **clients;
+    rbuffer **buffers;
+    int clients_capacity;
+    int clients_count;
+    int accept_paused; /// listening socket left out of epoll until a descriptor is freed
+    unsigned int pending_lines;
+    sigset_t original_mask;
+    int *variables_initialized;
+    int *active_circuits;
+    long *variables_values;
+    int *outputs_solvable;
+};
+
+void serve_circuit(const char *socket_path, ddag *dependency_graph, const ovariables *outputs, int completion_order);
+
+void open_listening_socket(cserver *server);
+
+void stop_listening(cserver *server);
+
+void watch_descriptor(cserver *server, int fd);
+
+void accept_clients(cserver *server);
+
+void handle_client(cserver *server, sclient *client, uint32_t events);
+
+void read_client(cserver *server, sclient *client);
+
+void write_client(cserver *server, sclient *client);
+
+void watch_client(cserver *server, sclient *client);
+
+void refresh_client(cserver *server, sclient *client);
+
+void dispatch_line(cserver *server, sclient *client, char *line);
+
+void close_client_input(cserver *server, sclient *client);
+
+void release_client_if_done(cserver *server, sclient *client);
+
+void drop_client(cserver *server, sclient *client);
+
+void close_worker_descriptors(cserver *server);
+
+#endif //PWZADANIE3_SERVER_H
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+#include "err.h"
+
+static tregion *region = NULL;
+static tspan local_spans[TRACE_LOCAL_SPANS];
+static unsigned int local_count = 0;
+static int current_line = 0;
+
+long trace_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void trace_open(unsigned long capacity) {
+    size_t size = sizeof(tregion) + capacity * sizeof(tspan);
+
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        syserr("Error in mmap\n");
+    }
+
+    region->count = 0;
+    region->dropped = 0;
+    region->capacity = capacity;
+    region->origin = trace_now();
+
+    /// Every process hands its spans over on exit, children must not repeat the parent's ones.
+    if (pthread_atfork(NULL, NULL, trace_reset_local) != 0) {
+        fatal("Error in pthread_atfork");
+    }
+
+    if (atexit(trace_flush) != 0) {
+        fatal("Error in atexit");
+    }
+}
+
+int trace_enabled() {
+    return region != NULL;
+}
+
+void trace_set_line(int line) {
+    current_line = line;
+}
+
+void trace_begin(tspan *span, const char *category, const char *format, long argument) {
+    if (region == NULL) {
+        return;
+    }
+
+    snprintf(span->name, TRACE_NAME_SIZE, format, argument);
+    span->category = category;
+    span->line = current_line;
+    span->pid = getpid();
+    span->parent = getppid();
+    span->begin = trace_now();
+}
+
+void trace_end(tspan *span) {
+    if (region == NULL) {
+        return;
+    }
+
+    span->end = trace_now();
+
+    if (local_count == TRACE_LOCAL_SPANS) {
+        trace_flush();
+    }
+
+    local_spans[local_count++] = *span;
+}
+
+void trace_flush() {
+    if (region == NULL || local_count == 0) {
+        return;
+    }
+
+    unsigned long first = __sync_fetch_and_add(&region->count, local_count);
+
+    for (unsigned int i = 0; i < local_count; ++i) {
+        if (first + i < region->capacity) {
+            region->spans[first + i] = local_spans[i];
+        } else {
+            __sync_fetch_and_add(&region->dropped, 1);
+        }
+    }
+
+    local_count = 0;
+}
+
+void trace_reset_local() {
+    local_count = 0;
+}
+
+void trace_write(const char *path) {
+    if (region == NULL) {
+        return;
+    }
+
+    trace_flush();
+
+    FILE *trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        syserr("Error while opening %s\n", path);
+    }
+
+    unsigned long count = region->count < region->capacity ? region->count : region->capacity;
+
+    /// Chrome trace event format, lines are shown as processes and evaluation processes as their threads.
+    fprintf(trace_file, "{\"traceEvents\":[");
+    for (unsigned long i = 0; i < count; ++i) {
+        tspan *span = &region->spans[i];
+
+        fprintf(trace_file,
+                "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"parent\":%d}}",
+                i == 0 ? "" : ",", span->name, span->category, (span->begin - region->origin) / 1000.0,
+                (span->end - span->begin) / 1000.0, span->line, (int) span->pid, (int) span->parent);
+    }
+    fprintf(trace_file, "\n],\"otherData\":{\"dropped_spans\":%lu}}\n", region->dropped);
+
+    if (fclose(trace_file) != 0) {
+        syserr("Error while closing %s\n", path);
+    }
+}
+
+void trace_close() {
+    if (region == NULL) {
+        return;
+    }
+
+    if (munmap(region, sizeof(tregion) + region->capacity * sizeof(tspan)) == -1) {
+        syserr("Error in munmap\n");
+    }
+
+    region = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef PWZADANIE3_TRACE_H
+#define PWZADANIE3_TRACE_H
+
+#include <sys/types.h>
+
+#define TRACE_CAPACITY      (1 << 20)
+#define TRACE_LOCAL_SPANS   64
+#define TRACE_NAME_SIZE     32
+
+typedef struct trace_span tspan;
+typedef struct trace_region tregion;
+
+/// Single evaluation unit: a line, a variable's tree, a circuit node or a wait for a variable.
+struct trace_span {
+    char name[TRACE_NAME_SIZE];
+    const char *category;
+    int line; /// equation number of the line, used as the trace process
+    pid_t pid;
+    pid_t parent;
+    long begin;
+    long end;
+};
+
+/// Shared by every process of the evaluation, filled from per-process buffers.
+struct trace_region {
+    unsigned long count;
+    unsigned long dropped;
+    unsigned long capacity;
+    long origin;
+    tspan spans[];
+};
+
+long trace_now();
+
+void trace_open(unsigned long capacity);
+
+int trace_enabled();
+
+void trace_set_line(int line);
+
+void trace_begin(tspan *span, const char *category, const char *format, long argument);
+
+void trace_end(tspan *span);
+
+void trace_flush();
+
+void trace_reset_local();
+
+void trace_write(const char *path);
+
+void trace_close();
+
+#endif //PWZADANIE3_TRACE_H